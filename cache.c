@@ -0,0 +1,837 @@
+/*
+ * cache.c - shared web object cache used by the caching proxies
+ *
+ *     Objects are stored at their actual size, as a header segment and a
+ *     body segment with explicit lengths (so binary bodies are fine),
+ *     and charged, with their URL, against a byte budget (MAX_CACHE_SIZE
+ *     by default). Inserting
+ *     evicts objects until the new one fits; which ones is up to the
+ *     eviction policy chosen at startup (policy.c), which sees every
+ *     hit, miss and insert. A hash index
+ *     from URL to block makes lookups independent of the number of
+ *     blocks. Objects are immutable and reference counted: a hit pins
+ *     the object and sends it with no cache lock held, and eviction or
+ *     replacement just unhooks it, so a slow client never holds up a
+ *     writer; the last unpin frees it. All of that state (blocks,
+ *     index, eviction policy state, byte budget) is split into shards
+ *     picked by URL hash, each with its own locks, so threads working on
+ *     unrelated URLs do not contend.
+ *
+ *     Responses are stored only if their headers allow it (freshness.c)
+ *     and are fresh until their TTL. A stale object that has a
+ *     validator stays a while longer so the proxy can revalidate it
+ *     and refresh it in place on a 304; a per-shard min-heap of
+ *     deadlines lets a background thread drop expired objects without
+ *     scanning.
+ *
+ *     With a disk tier (diskcache.c) evicted objects are written there
+ *     and a memory miss looks there before giving up, bringing the
+ *     object back into memory.
+ *
+ *     cache_save writes every object to a snapshot file and cache_load
+ *     maps one and feeds it back in from a background thread, so a
+ *     restarted proxy serves traffic at once and warms up meanwhile.
+ *
+ *     With compression on, text bodies are stored gzip'ed (deflate.c)
+ *     and charged at their compressed size. cache_body hands out the
+ *     compressed bytes to clients that accept gzip and a decompressed
+ *     copy to the rest.
+ *
+ *     Object blocks come from a slab allocator (slab.c) rather than
+ *     malloc, so steady insert and eviction churn does not fragment the
+ *     heap.
+ */
+#include "cache.h"
+
+Cache cache;
+
+#define SNAP_HEADER "CACHESN2" // snapshot 파일 맨 앞 8 bytes
+#define SNAP_MAGIC 0x50414e53u // record마다 맨 앞. "SNAP"
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+/* snapshot의 record header. URL(NUL 포함), header, body가 뒤따르고 record 전체를 8 bytes에 맞춘다 */
+typedef struct {
+  unsigned int magic;
+  unsigned int urllen, hdrlen, bodylen;
+  unsigned int rawlen, pad; // rawlen이 bodylen과 다르면 body는 gzip
+  time_t expires, ttl, deadline;
+  unsigned long cost_us;
+} snap_rec_t;
+
+static void *expire_thread(void *vargp);
+static void *load_thread(void *vargp);
+static cache_obj *insert(cache_shard *s, cache_obj *obj, time_t deadline, int promote);
+
+/* nshards는 1 이상, 그리고 shard 하나의 예산에 가장 큰 객체가 들어갈 만큼만 쓴다. policy가 NULL이면 LRU.
+   default_ttl은 Cache-Control도 Expires도 Last-Modified도 없는 응답이 fresh한 시간 */
+void cache_init(size_t max_bytes, int nshards, const cache_policy *policy, time_t default_ttl, int compress) {
+  cache_shard *s;
+  pthread_t tid;
+  int i, j;
+
+  if (nshards < 1)
+    nshards = 1;
+  if (nshards > CACHE_OBJS_COUNT)
+    nshards = CACHE_OBJS_COUNT;
+  while (nshards > 1 && max_bytes / nshards < MAX_OBJECT_SIZE + MAXLINE)
+    nshards--;
+  cache.nshards = nshards;
+  cache.policy = policy ? policy : &policy_lru;
+  cache.slots_per_shard = CACHE_OBJS_COUNT / nshards;
+  cache.default_ttl = default_ttl;
+  cache.compress = compress;
+  cache.shards = Malloc(nshards * sizeof(cache_shard));
+
+  for (j = 0; j < nshards; j++) {
+    s = &cache.shards[j];
+    s->first = j * cache.slots_per_shard;
+    s->nslots = cache.slots_per_shard;
+    s->max_bytes = max_bytes / nshards;
+    s->bytes = 0;
+    s->nobjs = 0;
+    s->evictions = 0;
+    s->hits = s->misses = 0;
+    s->saved_us = 0;
+    s->expired = s->revalidated = 0;
+    s->zobjs = s->zraw = s->zstored = s->zcpu_us = 0;
+    s->unzips = s->unzip_us = s->gzip_sent = 0;
+    s->timers = Malloc(s->nslots * sizeof(int));
+    s->ntimers = 0;
+    s->policy = cache.policy->create(s->nslots, s->max_bytes);
+    Sem_init(&s->insert_mutex, 0, 1);
+    s->free_slots = Malloc(s->nslots * sizeof(int));
+    for (i = 0; i < s->nslots; i++)
+      s->free_slots[i] = s->first + s->nslots - 1 - i;
+    s->nfree = s->nslots;
+
+    /* bucket 수는 block 수의 두 배 이상인 2의 거듭제곱. 체인 길이가 평균 1을 안 넘는다 */
+    for (s->nbuckets = 16; s->nbuckets < 2 * (unsigned int)s->nslots; s->nbuckets <<= 1)
+      ;
+    s->buckets = Malloc(s->nbuckets * sizeof(int));
+    for (i = 0; i < (int)s->nbuckets; i++)
+      s->buckets[i] = -1;
+    Sem_init(&s->index_mutex, 0, 1);
+  }
+  for (i=0; i<CACHE_OBJS_COUNT; i++) {
+    cache.cacheobjs[i].obj = NULL; // NULL이 비어있다는 뜻
+    cache.cacheobjs[i].hnext = -1;
+  }
+  Pthread_create(&tid, NULL, expire_thread, NULL);
+}
+
+/* FNV-1a */
+unsigned int cache_hash(const char *url) {
+  unsigned int h = 2166136261u;
+
+  while (*url)
+    h = (h ^ (unsigned char)*url++) * 16777619u;
+  return h;
+}
+
+/* shard는 hash의 위쪽 bits로, shard 안의 bucket은 아래쪽 bits로 고른다 */
+static cache_shard *shard_of(unsigned int h) {
+  return &cache.shards[(h >> 16) % cache.nshards];
+}
+
+/* block 하나하나 잠그며 strcmp 하던 선형 탐색 대신 index에서 찾는다.
+   체인에서는 hash가 같은 block만 URL을 비교한다. s의 index_mutex 안에서 부른다 */
+static int index_find(cache_shard *s, unsigned int h, char *url) {
+  int i;
+
+  for (i = s->buckets[h & (s->nbuckets - 1)]; i != -1; i = cache.cacheobjs[i].hnext)
+    if (cache.cacheobjs[i].hash == h && strcmp(url, cache.cacheobjs[i].obj->url) == 0)
+      break;
+  return i;
+}
+
+/* block i를 index에 넣고 뺀다. s의 index_mutex 안에서 부른다 */
+static void index_insert(cache_shard *s, int i) {
+  unsigned int bucket = cache.cacheobjs[i].hash & (s->nbuckets - 1);
+
+  cache.cacheobjs[i].hnext = s->buckets[bucket];
+  s->buckets[bucket] = i;
+}
+
+static void index_remove(cache_shard *s, int i) {
+  unsigned int bucket = cache.cacheobjs[i].hash & (s->nbuckets - 1);
+  int *p;
+
+  for (p = &s->buckets[bucket]; *p != -1; p = &cache.cacheobjs[*p].hnext)
+    if (*p == i) {
+      *p = cache.cacheobjs[i].hnext;
+      break;
+    }
+  cache.cacheobjs[i].hnext = -1;
+}
+
+/* shard의 timer heap. deadline이 가장 이른 block이 timers[0]. s의 index_mutex 안에서 부른다 */
+static void timer_set(cache_shard *s, int pos, int i) {
+  s->timers[pos] = i;
+  cache.cacheobjs[i].timer_pos = pos;
+}
+
+static void timer_up(cache_shard *s, int pos) {
+  int i = s->timers[pos];
+
+  while (pos > 0 && cache.cacheobjs[s->timers[(pos - 1) / 2]].deadline > cache.cacheobjs[i].deadline) {
+    timer_set(s, pos, s->timers[(pos - 1) / 2]);
+    pos = (pos - 1) / 2;
+  }
+  timer_set(s, pos, i);
+}
+
+static void timer_down(cache_shard *s, int pos) {
+  int i = s->timers[pos], c;
+
+  while ((c = 2 * pos + 1) < s->ntimers) {
+    if (c + 1 < s->ntimers && cache.cacheobjs[s->timers[c + 1]].deadline < cache.cacheobjs[s->timers[c]].deadline)
+      c++;
+    if (cache.cacheobjs[s->timers[c]].deadline >= cache.cacheobjs[i].deadline)
+      break;
+    timer_set(s, pos, s->timers[c]);
+    pos = c;
+  }
+  timer_set(s, pos, i);
+}
+
+static void timer_add(cache_shard *s, int i) {
+  timer_set(s, s->ntimers++, i);
+  timer_up(s, s->ntimers - 1);
+}
+
+/* deadline이 바뀐 block을 heap에서 제자리로 옮긴다 */
+static void timer_update(cache_shard *s, int i) {
+  timer_up(s, cache.cacheobjs[i].timer_pos);
+  timer_down(s, cache.cacheobjs[i].timer_pos);
+}
+
+/* 마지막 것을 빈 자리로 옮기고 제자리를 찾아 준다 */
+static void timer_remove(cache_shard *s, int i) {
+  int pos = cache.cacheobjs[i].timer_pos, last;
+
+  if (pos != --s->ntimers) {
+    last = s->timers[s->ntimers];
+    timer_set(s, pos, last);
+    timer_update(s, last);
+  }
+}
+
+/* 객체가 fresh한 동안, 그리고 validator가 있으면 stale이 된 뒤 CACHE_STALE_KEEP초 더 남겨 둔다 */
+static time_t deadline_of(cache_obj *obj, int validator) {
+  return obj->expires + (validator ? CACHE_STALE_KEEP : 0);
+}
+
+/* policy는 index_mutex 안에서 부른다. 그래서 hit가 알려 주는 block이 그 사이 쫒겨났을 수 없다.
+   block index는 shard 안의 slot 번호로 바꿔서 준다 */
+static void policy_insert(cache_shard *s, int i) {
+  cache_obj *obj = cache.cacheobjs[i].obj;
+
+  cache.policy->insert(s->policy, i - s->first, obj->hash, obj->size, obj->cost_us);
+}
+
+/* 객체를 disk tier의 형식으로 넘긴다 */
+static void obj_to_disk(cache_obj *obj, time_t deadline) {
+  disk_item_t it;
+
+  if (!diskcache_enabled())
+    return;
+  it.url = obj->url;
+  it.hdrs = obj->hdrs;
+  it.hdrlen = obj->hdrlen;
+  it.body = obj->body;
+  it.bodylen = obj->bodylen;
+  it.rawlen = obj->rawlen;
+  it.expires = obj->expires;
+  it.ttl = obj->ttl;
+  it.deadline = deadline;
+  it.cost_us = obj->cost_us;
+  diskcache_put(obj->hash, &it);
+}
+
+/* disk tier에 url이 있으면 obj_new와 같은 모양의 객체로 읽어 온다 (refs 1은 cache 자신의 것) */
+static cache_obj *obj_from_disk(char *url, unsigned int h, time_t *deadline) {
+  cache_obj *obj;
+  disk_item_t it;
+
+  if ((obj = diskcache_get(url, h, sizeof(cache_obj), slab_alloc, &it)) == NULL)
+    return NULL;
+  obj->url = it.url;
+  obj->hdrs = it.hdrs;
+  obj->hdrlen = it.hdrlen;
+  obj->body = it.body;
+  obj->bodylen = it.bodylen;
+  obj->rawlen = it.rawlen;
+  obj->gzip = it.rawlen != it.bodylen;
+  obj->size = it.hdrlen + it.bodylen + strlen(it.url) + 1;
+  obj->hash = h;
+  obj->cost_us = it.cost_us;
+  obj->expires = it.expires;
+  obj->ttl = it.ttl;
+  obj->refs = 1;
+  *deadline = it.deadline;
+  return obj;
+}
+
+/* obj_new나 obj_from_disk가 받은 block을 slab에 돌려준다. size가 URL, header, body 합이라 받을 때와 크기가 같다 */
+static void obj_free(cache_obj *obj) {
+  slab_free(obj, sizeof(cache_obj) + obj->size);
+}
+
+/* url의 객체를 찾아 pin 해서 돌려준다. lock은 하나도 잡지 않은 채로 돌아가므로
+   천천히 보내도 되고, 다 쓰면 cache_release 해야 한다. 없으면 NULL.
+   stale한 객체도 revalidate 하라고 돌려주지만 *fresh를 0으로 하고 miss로 센다.
+   메모리에 없으면 disk tier에서 찾아 메모리로 올린다. 그렇게 찾은 것도 hit다.
+   recheck면 같은 요청이 앞서 miss로 세어졌으니 miss는 다시 세지 않고, hit면 그 miss를 hit로 바꾼다 */
+static cache_obj *lookup(char *url, int *fresh, int recheck) {
+  unsigned int h = cache_hash(url);
+  cache_shard *s = shard_of(h);
+  cache_obj *obj = NULL;
+  time_t deadline;
+  int i;
+
+  *fresh = 0;
+  P(&s->index_mutex);
+  if ((i = index_find(s, h, url)) != -1) {
+    obj = cache.cacheobjs[i].obj;
+    obj->refs++;
+    *fresh = obj->expires > time(NULL);
+  }
+  if (*fresh) {
+    s->hits++;
+    if (recheck)
+      s->misses--;
+    s->saved_us += obj->cost_us;
+    cache.policy->hit(s->policy, i - s->first);
+  }
+  else if (!recheck) {
+    s->misses++;
+    if (cache.policy->miss)
+      cache.policy->miss(s->policy, h);
+  }
+  V(&s->index_mutex);
+
+  /* 위에서 miss로 세었으니 disk에 fresh한 것이 있으면 hit로 바꾼다. recheck는 방금 본 disk를 다시 보지 않는다 */
+  if (obj == NULL && !recheck && diskcache_enabled() && (obj = obj_from_disk(url, h, &deadline)) != NULL) {
+    /* cache_uri나 load_thread처럼 shard 예산보다 큰 객체는 (더 작은 -m으로 다시 띄운 경우) 올리지 않는다.
+       refs 1이 그대로 이 요청의 pin이 되어 이번만 보내고 release 할 때 free 된다 */
+    if (obj->size <= s->max_bytes)
+      obj = insert(s, obj, deadline, 1);
+    P(&s->index_mutex);
+    if ((*fresh = obj->expires > time(NULL))) {
+      s->hits++;
+      s->misses--;
+      s->saved_us += obj->cost_us;
+    }
+    V(&s->index_mutex);
+  }
+  return obj;
+}
+
+cache_obj *cache_lookup(char *url, int *fresh) {
+  return lookup(url, fresh, 0);
+}
+
+/* cache_lookup에서 miss 났던 요청이 origin에 가기 직전에 한 번 더 볼 때 쓴다 */
+cache_obj *cache_recheck(char *url, int *fresh) {
+  return lookup(url, fresh, 1);
+}
+
+/* stale한 obj를 origin이 304로 확인해 줬다. hdrs[0..hdrlen)은 그 304의 header.
+   body는 다시 받지 않고 fresh한 기간만 늘린다. 304에 Cache-Control이나 Expires가 있으면
+   그것을, 없으면 처음 받았을 때의 ttl을 쓴다. 그 사이 cache에서 빠졌거나 바뀌었으면 할 일이 없다 */
+void cache_refresh(cache_obj *obj, char *hdrs, size_t hdrlen) {
+  cache_shard *s = shard_of(obj->hash);
+  time_t now = time(NULL);
+  freshness_t f;
+  int i;
+
+  freshness_parse(hdrs, hdrlen, now, cache.default_ttl, &f);
+  P(&s->index_mutex);
+  if ((i = index_find(s, obj->hash, obj->url)) != -1 && cache.cacheobjs[i].obj == obj) {
+    obj->expires = f.explicit_ttl ? f.expires : now + obj->ttl;
+    cache.cacheobjs[i].deadline = deadline_of(obj, 1);
+    timer_update(s, i);
+    s->revalidated++;
+    cache.policy->hit(s->policy, i - s->first);
+  }
+  V(&s->index_mutex);
+}
+
+/* pin을 놓는다. 이미 cache에서 빠진 객체면 마지막으로 놓는 쪽이 free 한다 */
+void cache_release(cache_obj *obj) {
+  cache_shard *s = shard_of(obj->hash);
+  int refs;
+
+  P(&s->index_mutex);
+  refs = --obj->refs;
+  V(&s->index_mutex);
+  if (refs == 0)
+    obj_free(obj);
+}
+
+/* shard s에서 policy가 고른 block 하나를 비운다. s의 insert_mutex 안에서 부른다.
+   보내는 중인 reader가 있어도 기다리지 않는다. 객체는 그쪽이 놓을 때 free 된다.
+   policy가 비어서 쫒아낼 것이 없으면 -1 */
+static int cache_evict(cache_shard *s) {
+  cache_obj *obj;
+  time_t deadline;
+  int i;
+
+  P(&s->index_mutex);
+  if ((i = cache.policy->victim(s->policy)) == -1) {
+    V(&s->index_mutex);
+    return -1;
+  }
+  i += s->first;
+  index_remove(s, i);
+  timer_remove(s, i);
+  obj = cache.cacheobjs[i].obj;
+  cache.cacheobjs[i].obj = NULL;
+  deadline = cache.cacheobjs[i].deadline;
+  V(&s->index_mutex);
+  s->bytes -= obj->size;
+  s->free_slots[s->nfree++] = i;
+  s->nobjs--;
+  s->evictions++;
+  /* 쫒겨난 객체는 disk tier로 내려간다. 아직 pin을 잡고 있으니 객체는 그대로다 */
+  if (deadline > time(NULL))
+    obj_to_disk(obj, deadline);
+  cache_release(obj);
+  return 0;
+}
+
+/* deadline이 지난 객체들을 shard마다 heap 위에서부터 뺀다. 그렇지 않은 첫 객체에서 멈추니 훑지 않는다.
+   빼는 것은 cache_evict처럼 insert_mutex 안에서 하고, 보내는 중인 reader는 기다리지 않는다 */
+static void *expire_thread(void *vargp) {
+  cache_shard *s;
+  cache_obj *obj;
+  time_t now;
+  int i, j;
+
+  Pthread_detach(pthread_self());
+  while (1) {
+    Sleep(CACHE_EXPIRE_INTERVAL);
+    now = time(NULL);
+    for (j = 0; j < cache.nshards; j++) {
+      s = &cache.shards[j];
+      P(&s->insert_mutex);
+      while (1) {
+        obj = NULL;
+        P(&s->index_mutex);
+        if (s->ntimers > 0 && cache.cacheobjs[i = s->timers[0]].deadline <= now) {
+          timer_remove(s, i);
+          index_remove(s, i);
+          cache.policy->remove(s->policy, i - s->first);
+          obj = cache.cacheobjs[i].obj;
+          cache.cacheobjs[i].obj = NULL;
+        }
+        V(&s->index_mutex);
+        if (obj == NULL)
+          break;
+        s->bytes -= obj->size;
+        s->free_slots[s->nfree++] = i;
+        s->nobjs--;
+        s->expired++;
+        cache_release(obj);
+      }
+      V(&s->insert_mutex);
+    }
+  }
+  return NULL;
+}
+
+/* 응답 obj[0..len)에서 header가 끝나는 곳(빈 줄 다음)을 찾는다. 못 찾으면 0 */
+size_t cache_hdrlen(const char *obj, size_t len) {
+  size_t i;
+
+  for (i = 0; i + 4 <= len; i++)
+    if (obj[i] == '\r' && !memcmp(obj + i, "\r\n\r\n", 4))
+      return i + 4;
+  return 0;
+}
+
+/* header, body, URL을 slab에서 한 번에 받아 객체를 만든다. refs 1은 cache 자신의 것 */
+static cache_obj *obj_new(char *uri, size_t urllen, char *hdrs, size_t hdrlen, char *body, size_t bodylen,
+                          unsigned long cost_us) {
+  cache_obj *obj = slab_alloc(sizeof(cache_obj) + urllen + hdrlen + bodylen);
+
+  obj->url = (char *)(obj + 1);
+  memcpy(obj->url, uri, urllen);
+  obj->hdrs = obj->url + urllen;
+  memcpy(obj->hdrs, hdrs, hdrlen);
+  obj->hdrlen = hdrlen;
+  obj->body = bodylen > 0 ? obj->hdrs + hdrlen : NULL; // 204, 304 같은 응답은 body가 없다
+  if (bodylen > 0)
+    memcpy(obj->body, body, bodylen);
+  obj->bodylen = bodylen;
+  obj->gzip = 0;
+  obj->rawlen = bodylen;
+  obj->size = hdrlen + bodylen + urllen;
+  obj->hash = cache_hash(uri);
+  obj->cost_us = cost_us;
+  obj->refs = 1;
+  return obj;
+}
+
+/* 지금 쓰레드가 쓴 CPU 시간 */
+static unsigned long cpu_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* 압축해 볼 만한 응답인가. 이미 인코딩된 것은 두고, text 종류만 압축한다 */
+static int compressible(char *hdrs, size_t hdrlen, size_t bodylen) {
+  static const char *types[] = { "text/", "json", "javascript", "xml", NULL };
+  char type[128];
+  const char *v;
+  size_t vlen, i;
+
+  if (!cache.compress || bodylen < CACHE_ZMIN || http_header_value(hdrs, hdrlen, "Content-Encoding", &vlen)
+      || (v = http_header_value(hdrs, hdrlen, "Content-Type", &vlen)) == NULL)
+    return 0;
+  if (vlen >= sizeof(type))
+    vlen = sizeof(type) - 1;
+  for (i = 0; i < vlen; i++)
+    type[i] = tolower((unsigned char)v[i]);
+  type[vlen] = '\0';
+  for (i = 0; types[i]; i++)
+    if (strstr(type, types[i]))
+      return 1;
+  return 0;
+}
+
+/* body를 gzip으로 압축한 객체를 만든다. 압축할 응답이 아니거나 1/8도 줄지 않으면 NULL */
+static cache_obj *obj_gzip(cache_shard *s, char *uri, size_t urllen, char *hdrs, size_t hdrlen, char *body,
+                           size_t bodylen, unsigned long cost_us) {
+  cache_obj *obj = NULL;
+  unsigned long start;
+  size_t zlen;
+  char *z;
+
+  if (!compressible(hdrs, hdrlen, bodylen))
+    return NULL;
+  start = cpu_us();
+  z = Malloc(bodylen);
+  if ((zlen = gz_compress(body, bodylen, z, bodylen - bodylen / 8)) > 0) {
+    obj = obj_new(uri, urllen, hdrs, hdrlen, z, zlen, cost_us);
+    obj->gzip = 1;
+    obj->rawlen = bodylen;
+  }
+  Free(z);
+  P(&s->index_mutex);
+  s->zcpu_us += cpu_us() - start;
+  if (obj) {
+    s->zobjs++;
+    s->zraw += bodylen;
+    s->zstored += zlen;
+  }
+  V(&s->index_mutex);
+  return obj;
+}
+
+/* pin 한 obj의 보낼 body와 길이. 압축된 객체는 gzip_ok면 압축된 그대로, 아니면 풀어서 준다.
+   풀었으면 *freep에 Malloc 한 buffer가 오니 다 보내고 Free 한다 (아니면 NULL). 못 풀면 NULL */
+char *cache_body(cache_obj *obj, int gzip_ok, size_t *len, char **freep) {
+  cache_shard *s = shard_of(obj->hash);
+  unsigned long start;
+  char *raw;
+  int rc;
+
+  *freep = NULL;
+  *len = obj->bodylen;
+  if (!obj->gzip || gzip_ok) {
+    if (obj->gzip) {
+      P(&s->index_mutex);
+      s->gzip_sent++;
+      V(&s->index_mutex);
+    }
+    return obj->body;
+  }
+  start = cpu_us();
+  raw = Malloc(obj->rawlen);
+  rc = gz_decompress(obj->body, obj->bodylen, raw, obj->rawlen);
+  P(&s->index_mutex);
+  s->unzips++;
+  s->unzip_us += cpu_us() - start;
+  V(&s->index_mutex);
+  if (rc < 0) {
+    Free(raw);
+    return NULL;
+  }
+  *len = obj->rawlen;
+  return *freep = raw;
+}
+
+/* header가 shared cache에 넣어도 된다고 하는 응답인가 (freshness.c). cache_uri가 넣을지와
+   collapsed forwarding이 따라온 요청들에 나눠 줄지를 같은 판단으로 정한다 */
+int cache_storable(char *hdrs, size_t hdrlen) {
+  freshness_t f;
+
+  freshness_parse(hdrs, hdrlen, time(NULL), cache.default_ttl, &f);
+  return f.store;
+}
+
+// cache the uri and content in cache
+/* header와 body를 길이대로 넣는다. cost_us는 origin에서 받아오는 데 걸린 시간으로 policy가 참고한다.
+   header가 저장을 막거나 (no-store, private 등) 받자마자 버릴 응답이면 넣지 않는다.
+   복사는 lock 밖에서 끝내 둔다. 같은 URL이 이미 있으면 새 객체로 바꿔 끼우고,
+   URL의 shard에서 예산이나 block이 모자라면 policy가 고른 것부터 쫒아낸다 */
+void cache_uri(char *uri, char *hdrs, size_t hdrlen, char *body, size_t bodylen, unsigned long cost_us) {
+  size_t urllen = strlen(uri) + 1;
+  cache_shard *s = shard_of(cache_hash(uri));
+  cache_obj *obj;
+  time_t now = time(NULL);
+  freshness_t f;
+
+  if (hdrlen + bodylen > MAX_OBJECT_SIZE || hdrlen + bodylen + urllen > s->max_bytes)
+    return;
+  freshness_parse(hdrs, hdrlen, now, cache.default_ttl, &f);
+  if (!f.store)
+    return;
+  if ((obj = obj_gzip(s, uri, urllen, hdrs, hdrlen, body, bodylen, cost_us)) == NULL)
+    obj = obj_new(uri, urllen, hdrs, hdrlen, body, bodylen, cost_us);
+  obj->expires = f.expires;
+  obj->ttl = f.expires - now;
+  insert(s, obj, deadline_of(obj, f.validator), 0);
+}
+
+/* obj를 shard s에 넣는다. 같은 URL이 이미 있으면 promote가 아닐 때는 바꿔 끼우고,
+   promote면 (disk에서 올리는 중) 있는 쪽을 두고 obj는 버린다. promote면 돌려주는 객체를 pin 해 준다.
+   쫒아낼 것이 없어 block을 못 얻으면 넣지 않는다. promote면 obj의 refs 1을 pin으로 돌려주고
+   아니면 obj를 버리고 NULL */
+static cache_obj *insert(cache_shard *s, cache_obj *obj, time_t deadline, int promote) {
+  cache_obj *old = NULL;
+  int i;
+
+  P(&s->insert_mutex);
+  /* disk에 남은 예전 것은 이제 틀린 사본이다. 예전 것을 disk로 내리는 eviction과 순서가 섞이지 않게
+     insert_mutex 안에서 지운다 */
+  if (!promote)
+    diskcache_remove(obj->url, obj->hash);
+  P(&s->index_mutex);
+  if ((i = index_find(s, obj->hash, obj->url)) != -1 && promote) {
+    obj_free(obj);
+    obj = cache.cacheobjs[i].obj;
+    obj->refs++;
+    V(&s->index_mutex);
+    V(&s->insert_mutex);
+    return obj;
+  }
+  if (i != -1) {
+    old = cache.cacheobjs[i].obj;
+    cache.cacheobjs[i].obj = obj;
+    /* 크기가 바뀌었을 수 있으니 policy에는 새로 넣는다 */
+    cache.policy->remove(s->policy, i - s->first);
+    policy_insert(s, i);
+    cache.cacheobjs[i].deadline = deadline;
+    timer_update(s, i);
+  }
+  V(&s->index_mutex);
+  if (old) {
+    s->bytes += obj->size - old->size;
+    cache_release(old);
+  }
+  else {
+    while ((s->bytes + obj->size > s->max_bytes || s->nfree == 0) && cache_evict(s) == 0)
+      ;
+    if (s->nfree == 0) {
+      V(&s->insert_mutex);
+      if (promote)
+        return obj;
+      obj_free(obj);
+      return NULL;
+    }
+    i = s->free_slots[--s->nfree]; // 빈 캐시 블럭
+    cache.cacheobjs[i].obj = obj;
+    cache.cacheobjs[i].hash = obj->hash;
+    cache.cacheobjs[i].deadline = deadline;
+    P(&s->index_mutex);
+    index_insert(s, i);
+    timer_add(s, i);
+    policy_insert(s, i);
+    if (promote)
+      obj->refs++;
+    V(&s->index_mutex);
+    s->bytes += obj->size;
+    s->nobjs++;
+  }
+  /* 바꿔 끼워서 커졌으면 예산에 맞게 줄인다 */
+  while (s->bytes > s->max_bytes && cache_evict(s) == 0)
+    ;
+  V(&s->insert_mutex);
+  return obj;
+}
+
+/* shard들을 합친다. shard 하나씩 잠그니까 합계가 한 순간의 값은 아니다 */
+void cache_stats(cache_stats_t *st) {
+  cache_shard *s;
+  int j;
+
+  memset(st, 0, sizeof(*st));
+  st->shards = cache.nshards;
+  st->policy = cache.policy->name;
+  for (j = 0; j < cache.nshards; j++) {
+    s = &cache.shards[j];
+    P(&s->insert_mutex);
+    st->objects += s->nobjs;
+    st->bytes += s->bytes;
+    st->max_bytes += s->max_bytes;
+    st->evictions += s->evictions;
+    V(&s->insert_mutex);
+    P(&s->index_mutex);
+    st->hits += s->hits;
+    st->misses += s->misses;
+    st->saved_us += s->saved_us;
+    st->expired += s->expired;
+    st->revalidated += s->revalidated;
+    st->zobjs += s->zobjs;
+    st->zraw += s->zraw;
+    st->zstored += s->zstored;
+    st->zcpu_us += s->zcpu_us;
+    st->unzips += s->unzips;
+    st->unzip_us += s->unzip_us;
+    st->gzip_sent += s->gzip_sent;
+    V(&s->index_mutex);
+  }
+}
+
+/* 객체 하나를 record로 쓴다. 쓰다 실패하면 -1 */
+static int snap_write(FILE *fp, cache_obj *obj, time_t deadline) {
+  static const char pad[8];
+  size_t urllen = strlen(obj->url) + 1;
+  snap_rec_t r;
+
+  r.magic = SNAP_MAGIC;
+  r.urllen = urllen;
+  r.hdrlen = obj->hdrlen;
+  r.bodylen = obj->bodylen;
+  r.rawlen = obj->rawlen;
+  r.pad = 0;
+  r.expires = obj->expires;
+  r.ttl = obj->ttl;
+  r.deadline = deadline;
+  r.cost_us = obj->cost_us;
+  if (fwrite(&r, sizeof(r), 1, fp) != 1 || fwrite(obj->url, 1, urllen, fp) != urllen
+      || fwrite(obj->hdrs, 1, obj->hdrlen, fp) != obj->hdrlen
+      || (obj->bodylen > 0 && fwrite(obj->body, 1, obj->bodylen, fp) != obj->bodylen))
+    return -1;
+  urllen = ALIGN8(sizeof(r) + urllen + obj->hdrlen + obj->bodylen) - (sizeof(r) + urllen + obj->hdrlen + obj->bodylen);
+  return fwrite(pad, 1, urllen, fp) == urllen ? 0 : -1;
+}
+
+/* cache에 든 객체를 모두 path에 snapshot으로 쓴다. path.tmp에 다 쓴 뒤 rename 하므로 중간에 죽어도
+   예전 snapshot은 그대로다. shard마다 객체들을 pin 해 두고 lock 밖에서 쓴다. 쓴 객체 수, 실패하면 -1 */
+int cache_save(const char *path) {
+  char tmp[MAXLINE];
+  cache_obj **objs;
+  time_t *deadlines;
+  cache_shard *s;
+  int i, j, k, n, saved = 0, err = 0;
+  FILE *fp;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((fp = fopen(tmp, "w")) == NULL)
+    return -1;
+  err = fwrite(SNAP_HEADER, 1, 8, fp) != 8;
+  objs = Malloc(cache.slots_per_shard * sizeof(cache_obj *));
+  deadlines = Malloc(cache.slots_per_shard * sizeof(time_t));
+  for (j = 0; j < cache.nshards; j++) {
+    s = &cache.shards[j];
+    n = 0;
+    P(&s->index_mutex);
+    for (i = s->first; i < s->first + s->nslots; i++)
+      if (cache.cacheobjs[i].obj != NULL) {
+        objs[n] = cache.cacheobjs[i].obj;
+        objs[n]->refs++;
+        deadlines[n++] = cache.cacheobjs[i].deadline;
+      }
+    V(&s->index_mutex);
+    for (k = 0; k < n; k++) {
+      if (!err) {
+        err = snap_write(fp, objs[k], deadlines[k]) < 0;
+        saved += !err;
+      }
+      cache_release(objs[k]);
+    }
+  }
+  Free(objs);
+  Free(deadlines);
+  if (fclose(fp) != 0)
+    err = 1;
+  if (err || rename(tmp, path) < 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return saved;
+}
+
+/* path의 snapshot을 background thread로 읽어 들인다. 그동안 proxy는 이미 요청을 받고,
+   아직 안 들어온 URL은 그냥 miss다. 파일이 없으면 빈 cache로 시작한다 */
+void cache_load(const char *path) {
+  pthread_t tid;
+
+  Pthread_create(&tid, NULL, load_thread, strdup(path));
+}
+
+/* snapshot을 mmap 해서 record마다 객체를 만들어 넣는다. deadline이 지났거나 그 사이 새로 받아 둔
+   URL은 건너뛴다. 잘렸거나 깨진 record를 만나면 거기서 멈춘다 */
+static void *load_thread(void *vargp) {
+  char *path = vargp, *base, *url;
+  size_t off, len, total;
+  struct timespec start, end;
+  struct stat sb;
+  cache_obj *obj;
+  snap_rec_t *r;
+  time_t now = time(NULL);
+  int fd, loaded = 0, skipped = 0;
+
+  Pthread_detach(pthread_self());
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    Free(path);
+    return NULL;
+  }
+  Fstat(fd, &sb);
+  if ((size_t)sb.st_size < 8) {
+    Close(fd);
+    Free(path);
+    return NULL;
+  }
+  total = sb.st_size;
+  base = Mmap(NULL, total, PROT_READ, MAP_PRIVATE, fd, 0);
+  Close(fd);
+  madvise(base, total, MADV_SEQUENTIAL);
+  if (memcmp(base, SNAP_HEADER, 8) != 0)
+    total = 0; /* snapshot 파일이 아니다 */
+
+  for (off = 8; off + sizeof(snap_rec_t) <= total; off += len) {
+    r = (snap_rec_t *)(base + off);
+    len = ALIGN8(sizeof(*r) + (size_t)r->urllen + r->hdrlen + r->bodylen);
+    if (r->magic != SNAP_MAGIC || r->urllen == 0 || off + len > total)
+      break;
+    url = (char *)(r + 1);
+    if (url[r->urllen - 1] != '\0' || strlen(url) + 1 != r->urllen || r->deadline <= now
+        || (size_t)r->hdrlen + r->bodylen > MAX_OBJECT_SIZE || r->rawlen < r->bodylen || r->rawlen > MAX_OBJECT_SIZE
+        || (size_t)r->urllen + r->hdrlen + r->bodylen > shard_of(cache_hash(url))->max_bytes) {
+      skipped++;
+      continue;
+    }
+    obj = obj_new(url, r->urllen, url + r->urllen, r->hdrlen, url + r->urllen + r->hdrlen, r->bodylen,
+                  r->cost_us);
+    obj->expires = r->expires;
+    obj->ttl = r->ttl;
+    obj->rawlen = r->rawlen;
+    obj->gzip = r->rawlen != r->bodylen;
+    cache_release(insert(shard_of(obj->hash), obj, r->deadline, 1));
+    loaded++;
+  }
+  Munmap(base, sb.st_size);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("snapshot: loaded %d objects from %s in %.3f ms, skipped %d\n", loaded, path,
+         (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6, skipped);
+  fflush(stdout);
+  Free(path);
+  return NULL;
+}
@@ -0,0 +1,124 @@
+/*
+ * cache.h - shared web object cache used by the caching proxies
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+#include "policy.h"
+#include "freshness.h"
+#include "diskcache.h"
+#include "deflate.h"
+#include "slab.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000 // 기본 byte 예산 (cache_init에 다른 값을 줄 수 있다)
+#ifndef MAX_OBJECT_SIZE
+#define MAX_OBJECT_SIZE 102400
+#endif
+// 어떤 객체를 쫒아낼지는 policy.c의 eviction policy가 정한다 (LRU, CLOCK, S3-FIFO, W-TinyLFU, GDSF)
+
+#ifndef CACHE_OBJS_COUNT
+#define CACHE_OBJS_COUNT 8192 // 객체 수 상한. 크기는 byte 예산이 정한다
+#endif
+#define CACHE_SHARDS 16 // 기본 shard 수 (cache_init에 다른 값을 줄 수 있다)
+#define CACHE_STALE_KEEP 600 // validator가 있는 객체는 stale이 된 뒤에도 이만큼 (초) 남겨 두고 revalidate 한다
+#define CACHE_EXPIRE_INTERVAL 1 // expiry thread가 깨는 간격 (초)
+#define CACHE_ZMIN 256 // 압축을 켰을 때 이보다 짧은 body는 압축하지 않는다
+
+/* cache에 든 응답 하나. header와 body는 넣은 뒤로 바뀌지 않는다. 읽는 쪽은 refs를 올려 (pin) 잡아 두고
+   lock 없이 보낸 다음 cache_release 한다. 마지막 ref가 놓일 때 free 된다 */
+typedef struct
+{
+  char *hdrs; // 응답 header (마지막 빈 줄까지)
+  size_t hdrlen;
+  char *body; // body. NUL이 섞여 있어도 된다
+  size_t bodylen;
+  int gzip; // body를 gzip으로 압축해 두었다. 원래 header는 hdrs 그대로다
+  size_t rawlen; // 원래 body 길이. 압축하지 않았으면 bodylen과 같다
+  char *url;
+  size_t size; // 이 객체가 예산에서 차지하는 bytes (header + body + URL)
+  unsigned int hash; // url의 hash
+  unsigned long cost_us; // origin에서 가져오는 데 걸린 시간. hit 한 번마다 이만큼 아낀다
+  time_t expires; // 이때까지 fresh. revalidate 되면 늘어난다 (index_mutex가 보호)
+  time_t ttl; // 받은 때부터 fresh한 시간. 304가 따로 알려 주지 않으면 revalidate 뒤에 이만큼 다시 fresh
+  int refs; // cache 자신 + pin한 reader 수. shard의 index_mutex가 보호
+}cache_obj;
+
+typedef struct
+{
+  cache_obj *obj; // NULL이면 빈 block
+  unsigned int hash; // obj->url의 hash. index에서 hash가 같은 key만 strcmp 한다
+  int hnext; // 같은 bucket의 다음 block index, -1이면 끝
+  time_t deadline; // 이때 expiry thread가 뺀다
+  int timer_pos; // shard의 timer heap에서의 위치
+}cache_block; // 캐쉬블럭 구조체로 선언
+
+
+/* URL hash로 고르는 cache의 한 조각. block 범위, index, policy 상태, byte 예산을 따로 가지고
+   따로 잠그므로 다른 shard의 URL을 다루는 쓰레드끼리는 lock을 다투지 않는다 */
+typedef struct
+{
+  int first, nslots; // 이 shard의 block index는 [first, first + nslots)
+  size_t bytes; // 지금 들어 있는 bytes
+  size_t max_bytes; // 이 shard의 byte 예산
+  int nobjs;
+  unsigned long evictions;
+  int *free_slots; // 빈 block index stack
+  int nfree;
+  sem_t insert_mutex; // 이 shard의 cache_uri끼리 순서를 정하고 위의 값들을 보호
+  void *policy; // eviction policy 상태. block은 first를 뺀 slot 번호로 알려준다
+  unsigned long hits, misses; // cache_lookup 결과
+  unsigned long saved_us; // hit된 객체들의 cost_us 합
+  unsigned long expired, revalidated;
+  unsigned long zobjs, zraw, zstored, zcpu_us; // 압축해서 넣은 객체 수, 원래 bytes, 압축된 bytes, 압축에 쓴 CPU 시간
+  unsigned long unzips, unzip_us, gzip_sent; // 풀어서 보낸 횟수와 CPU 시간, 압축된 그대로 보낸 횟수
+  int *timers; // deadline이 이른 block부터 min-heap
+  int ntimers;
+  int *buckets; // url hash -> 첫 block index, -1이면 빈 bucket
+  unsigned int nbuckets; // 2의 거듭제곱
+  sem_t index_mutex; // bucket 체인들, block의 obj, 객체의 refs와 expires, policy 상태, timer heap, 위의 counter들을 보호
+}cache_shard;
+
+typedef struct
+{
+  cache_block cacheobjs[CACHE_OBJS_COUNT];
+  cache_shard *shards;
+  const cache_policy *policy;
+  int nshards;
+  int slots_per_shard; // block i는 shards[i / slots_per_shard] 것
+  time_t default_ttl; // freshness 정보가 없는 응답의 수명
+  int compress; // text body를 gzip으로 압축해서 넣는다
+}Cache;
+
+extern Cache cache;
+
+// cache function
+/* Snapshot returned by cache_stats */
+typedef struct {
+  int objects, shards;
+  size_t bytes, max_bytes;
+  unsigned long evictions;
+  unsigned long hits, misses;
+  unsigned long saved_us; // hit 덕분에 origin에 가지 않은 시간
+  unsigned long expired, revalidated;
+  unsigned long zobjs, zraw, zstored, zcpu_us;
+  unsigned long unzips, unzip_us, gzip_sent;
+  const char *policy;
+} cache_stats_t;
+
+void cache_init(size_t max_bytes, int nshards, const cache_policy *policy, time_t default_ttl, int compress);
+unsigned int cache_hash(const char *url);
+cache_obj *cache_lookup(char *url, int *fresh);
+cache_obj *cache_recheck(char *url, int *fresh);
+void cache_refresh(cache_obj *obj, char *hdrs, size_t hdrlen);
+void cache_release(cache_obj *obj);
+char *cache_body(cache_obj *obj, int gzip_ok, size_t *len, char **freep);
+size_t cache_hdrlen(const char *obj, size_t len);
+int cache_storable(char *hdrs, size_t hdrlen);
+void cache_uri(char *uri, char *hdrs, size_t hdrlen, char *body, size_t bodylen, unsigned long cost_us);
+void cache_stats(cache_stats_t *st);
+int cache_save(const char *path);
+void cache_load(const char *path);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,95 @@
+/*
+ * cachebench.c - lookup latency of the cache as the entry count grows
+ *
+ *     Fills one cache step by step from 10 up to 1,000,000 small objects
+ *     and, at each step, times cache_lookup + cache_release of random keys
+ *     that are present. Keys are made before the clock starts, so only
+ *     the lookup (hash, shard, index chain, policy hit) is measured.
+ *
+ *     The cache is sized at build time: make bench compiles cache.c with
+ *     CACHE_OBJS_COUNT large enough for the last step and a small
+ *     MAX_OBJECT_SIZE, so the byte budget below holds every object and
+ *     nothing is evicted.
+ *
+ * usage: cachebench [lookups per step]
+ */
+#include "cache.h"
+
+#define BENCH_MAX_ENTRIES 1000000
+#define BENCH_LOOKUPS 1000000
+#define BENCH_KEYLEN 32
+
+#if CACHE_OBJS_COUNT < BENCH_MAX_ENTRIES
+#error "build with -DCACHE_OBJS_COUNT of at least BENCH_MAX_ENTRIES (make bench)"
+#endif
+
+static const char bench_hdrs[] = "HTTP/1.0 200 OK\r\nCache-Control: max-age=3600\r\n\r\n";
+
+/* xorshift64, so every run looks up the same keys */
+static unsigned long long rng = 88172645463325252ULL;
+
+static unsigned long long next_rand(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static double elapsed_ns(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+    static const int steps[] = { 10, 100, 1000, 10000, 100000, BENCH_MAX_ENTRIES };
+    struct timespec start, end;
+    char *keys, **order;
+    cache_obj *obj;
+    cache_stats_t st;
+    long lookups = argc > 1 ? atol(argv[1]) : BENCH_LOOKUPS;
+    int i, n = 0, step, fresh, missing;
+
+    if (lookups < 1) {
+        fprintf(stderr, "usage: %s [lookups per step]\n", argv[0]);
+        exit(1);
+    }
+    /* The proxy's default shard count; 4 KB of budget per object is far
+       more than one takes, so only running out of blocks could evict */
+    cache_init((size_t)BENCH_MAX_ENTRIES * 4096, CACHE_SHARDS, NULL, 3600, 0);
+    keys = Malloc((size_t)BENCH_MAX_ENTRIES * BENCH_KEYLEN);
+    for (i = 0; i < BENCH_MAX_ENTRIES; i++)
+        snprintf(keys + (size_t)i * BENCH_KEYLEN, BENCH_KEYLEN, "http://bench.test/obj/%d", i);
+    order = Malloc(lookups * sizeof(char *));
+
+    printf("%10s %12s %12s\n", "entries", "ns/lookup", "lookups");
+    for (step = 0; step < (int)(sizeof(steps) / sizeof(steps[0])); step++) {
+        for (; n < steps[step]; n++)
+            cache_uri(keys + (size_t)n * BENCH_KEYLEN, (char *)bench_hdrs, sizeof(bench_hdrs) - 1, "x", 1, 1000);
+        for (i = 0; i < lookups; i++)
+            order[i] = keys + (size_t)(next_rand() % n) * BENCH_KEYLEN;
+
+        missing = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < lookups; i++) {
+            if ((obj = cache_lookup(order[i], &fresh)) == NULL) {
+                missing++;
+                continue;
+            }
+            cache_release(obj);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%10d %12.1f %12ld\n", n, elapsed_ns(&start, &end) / lookups, lookups);
+        if (missing) {
+            fprintf(stderr, "cachebench: %d of %ld keys were not found\n", missing, lookups);
+            exit(1);
+        }
+    }
+
+    cache_stats(&st);
+    printf("cache: %d objects, %lu evictions, %d shards, %s\n", st.objects, st.evictions, st.shards, st.policy);
+    Free(order);
+    Free(keys);
+    exit(0);
+}
@@ -0,0 +1,226 @@
+/*
+ * cachekey.c - canonical cache keys for request URIs
+ *
+ *     Requests for the same resource can be spelled differently:
+ *     http://Host:80/a, http://host/a and http://host/a#top all name
+ *     one object, and keying the cache on the raw URI stores it three
+ *     times. cachekey_make rewrites a URI with the normalizations of RFC
+ *     3986 6.2.2 that cannot change what the origin returns: lowercase
+ *     scheme and host, no default port, no fragment, an empty path as
+ *     "/", and percent escapes of unreserved characters decoded while
+ *     the rest get uppercase hex digits. Optionally, configured query
+ *     parameters (tracking tags and the like) are dropped and the rest
+ *     sorted by name. The origin still gets the request as sent.
+ */
+#include "cachekey.h"
+
+/* Query parameter patterns to drop; a trailing '*' matches any suffix */
+static char *strip[CACHEKEY_MAX_STRIP];
+static int nstrip;
+static int sort_query;
+
+/*
+ * cachekey_init - Set the query parameters to drop from keys, as a
+ *     comma separated list of names (NULL for none), and whether to sort
+ *     the remaining parameters. Call once before any cachekey_make.
+ */
+void cachekey_init(const char *list, int sort)
+{
+    char *copy, *name, *save;
+
+    sort_query = sort;
+    if (list == NULL)
+        return;
+    copy = strdup(list);
+    for (name = strtok_r(copy, ",", &save); name && nstrip < CACHEKEY_MAX_STRIP; name = strtok_r(NULL, ",", &save))
+        if (*name)
+            strip[nstrip++] = strdup(name);
+    Free(copy);
+}
+
+static int hexval(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c = tolower(c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+static int unreserved(int c)
+{
+    return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/* Copy [p, end) to o with percent escapes normalized. Never longer than the input */
+static char *pct_copy(char *o, const char *p, const char *end)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    int hi, lo;
+
+    while (p < end) {
+        if (*p == '%' && end - p >= 3 && (hi = hexval(p[1])) >= 0 && (lo = hexval(p[2])) >= 0) {
+            if (unreserved(hi << 4 | lo)) {
+                *o++ = hi << 4 | lo;
+            } else {
+                *o++ = '%';
+                *o++ = hex[hi];
+                *o++ = hex[lo];
+            }
+            p += 3;
+        } else {
+            *o++ = *p++;
+        }
+    }
+    return o;
+}
+
+/* Length of the name part of parameter p (up to '=' or its end) */
+static size_t name_len(const char *p, size_t len)
+{
+    const char *eq = memchr(p, '=', len);
+
+    return eq ? (size_t)(eq - p) : len;
+}
+
+static int stripped(const char *p, size_t len)
+{
+    size_t n = name_len(p, len), m;
+    int i;
+
+    for (i = 0; i < nstrip; i++) {
+        m = strlen(strip[i]);
+        if (m > 0 && strip[i][m - 1] == '*') {
+            if (n >= m - 1 && !memcmp(p, strip[i], m - 1))
+                return 1;
+        } else if (n == m && !memcmp(p, strip[i], m)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Order by name only, so repeated names keep the order they came in */
+static int name_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+    size_t an = name_len(a, alen), bn = name_len(b, blen);
+    int c = memcmp(a, b, an < bn ? an : bn);
+
+    return c ? c : (an > bn) - (an < bn);
+}
+
+/*
+ * query_copy - Write the normalized query [p, end) (without its '?') to
+ *     o, preceded by '?' unless no parameter is left.
+ */
+static char *query_copy(char *o, const char *p, const char *end)
+{
+    char *buf, *t, *tend, *amp;
+    char **param;
+    size_t *plen, len;
+    int n = 0, i, j;
+
+    buf = Malloc(end - p + 1);
+    tend = pct_copy(buf, p, end);       /* '&' and '=' are never decoded into */
+    param = Malloc(((end - p) / 2 + 1) * sizeof(char *));
+    plen = Malloc(((end - p) / 2 + 1) * sizeof(size_t));
+    for (t = buf; t < tend; t = amp + 1) {
+        if ((amp = memchr(t, '&', tend - t)) == NULL)
+            amp = tend;
+        len = amp - t;
+        if (len == 0 || stripped(t, len))
+            continue;
+        /* Insertion sort keeps equal names stable; queries are short */
+        for (j = n; sort_query && j > 0 && name_cmp(param[j - 1], plen[j - 1], t, len) > 0; j--) {
+            param[j] = param[j - 1];
+            plen[j] = plen[j - 1];
+        }
+        param[j] = t;
+        plen[j] = len;
+        n++;
+    }
+    for (i = 0; i < n; i++) {
+        *o++ = i == 0 ? '?' : '&';
+        memcpy(o, param[i], plen[i]);
+        o += plen[i];
+    }
+    Free(param);
+    Free(plen);
+    Free(buf);
+    return o;
+}
+
+/*
+ * cachekey_make - Canonical key for uri, absolute ("http://host/path") or
+ *     without a scheme ("host/path", read as http like parse_uri does).
+ *     Malloc'ed; the caller Frees it.
+ */
+cachekey_t *cachekey_make(const char *uri)
+{
+    const char *p = uri, *end, *auth, *host, *colon, *q;
+    cachekey_t *k;
+    long port = -1, defport = 80;
+    char *o;
+
+    end = uri + strcspn(uri, "#");
+    k = Malloc(sizeof(cachekey_t) + (end - uri) + sizeof("http:///"));
+    o = k->s;
+
+    /* Scheme */
+    for (q = uri; isalnum((unsigned char)*q) || *q == '+' || *q == '-' || *q == '.'; q++)
+        ;
+    if (q > uri && q < end && !strncmp(q, "://", 3)) {
+        for (; p < q; p++)
+            *o++ = tolower((unsigned char)*p);
+        p += 3;
+    } else {
+        o += sprintf(o, "http");
+    }
+    *o = '\0';
+    if (!strcmp(k->s, "https"))
+        defport = 443;
+    o += sprintf(o, "://");
+
+    /* Authority: user info as is, host lowercased, port without leading zeros unless it is the default */
+    auth = p;
+    p += strcspn(p, "/?");
+    if (p > end)
+        p = end;
+    for (host = auth, q = auth; q < p; q++)
+        if (*q == '@')
+            host = q + 1;
+    for (colon = NULL, q = host; q < p; q++)
+        if (*q == ':')
+            colon = q;
+        else if (*q == ']')
+            colon = NULL;       /* Inside an IPv6 literal */
+    memcpy(o, auth, host - auth);
+    o += host - auth;
+    for (q = host; q < (colon ? colon : p); q++)
+        *o++ = tolower((unsigned char)*q);
+    if (colon) {
+        if (colon + 1 == p) {
+            port = defport;     /* "host:" means the default port */
+        } else if ((size_t)(p - colon - 1) == strspn(colon + 1, "0123456789") && p - colon - 1 <= 9) {
+            for (port = 0, q = colon + 1; q < p; q++)
+                port = port * 10 + *q - '0';
+        } else {
+            memcpy(o, colon, p - colon);        /* Not a number: leave it for the origin to reject */
+            o += p - colon;
+        }
+        if (port >= 0 && port != defport)
+            o += sprintf(o, ":%ld", port);
+    }
+
+    /* Path, then query */
+    if (p == end || *p == '?')
+        *o++ = '/';
+    q = p + strcspn(p, "?");
+    if (q > end)
+        q = end;
+    o = pct_copy(o, p, q);
+    if (q < end)
+        o = query_copy(o, q + 1, end);
+    *o = '\0';
+    k->len = o - k->s;
+    return k;
+}
@@ -0,0 +1,20 @@
+/*
+ * cachekey.h - canonical cache keys for request URIs
+ */
+#ifndef __CACHEKEY_H__
+#define __CACHEKEY_H__
+
+#include "csapp.h"
+
+#define CACHEKEY_MAX_STRIP 32   /* Query parameter patterns cachekey_init keeps */
+
+/* A key as a length-prefixed string */
+typedef struct {
+    size_t len;               /* Bytes in s, not counting the NUL */
+    char s[];                 /* NUL terminated, so it also works as a C string */
+} cachekey_t;
+
+void cachekey_init(const char *strip, int sort);
+cachekey_t *cachekey_make(const char *uri);
+
+#endif /* __CACHEKEY_H__ */
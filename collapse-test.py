@@ -0,0 +1,150 @@
+#!/usr/bin/python3
+
+# collapse-test.py - Regression test for collapsed forwarding: a response
+#                    that must not be shared (Cache-Control: private,
+#                    Set-Cookie, Vary) is never handed to a concurrent
+#                    miss on the same URL from another client.
+#
+#                    Starts a slow origin that answers with the cookie it
+#                    was sent, then two clients with different cookies
+#                    request the same URL through the proxy at once. Each
+#                    must get its own answer. Also checks that a shared
+#                    body bigger than the proxy buffers, ending at EOF,
+#                    reaches both clients whole, and that a body too big
+#                    for the cache that nobody else asked for is still
+#                    relayed with splice (per the SIGUSR1 stats).
+#
+# usage: collapse-test.py <proxy binary>
+#
+import os
+import re
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+HEADERS = {
+    '/private': 'Cache-Control: private\r\n',
+    '/cookie': 'Cache-Control: max-age=60\r\nSet-Cookie: session=%s\r\n',
+    '/vary': 'Cache-Control: max-age=60\r\nVary: Cookie\r\n',
+}
+BIG = 6 << 20                   # Past the proxy's 4MB flight buffer
+LONE = 1 << 20                  # Too big to cache, small enough to share
+
+def free_port():
+    s = socket.socket()
+    s.bind(('', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+def origin(listener):
+    while True:
+        conn, _ = listener.accept()
+        threading.Thread(target=serve, args=(conn,), daemon=True).start()
+
+def serve(conn):
+    req = b''
+    while b'\r\n\r\n' not in req:
+        data = conn.recv(4096)
+        if not data:
+            conn.close()
+            return
+        req += data
+    lines = req.decode().split('\r\n')
+    path = lines[0].split()[1]
+    cookie = ''
+    for line in lines[1:]:
+        if line.lower().startswith('cookie:'):
+            cookie = line.split(':', 1)[1].strip()
+    time.sleep(0.5)             # Keep the fetch in flight while the other client misses
+    if path in ('/big', '/lone-eof', '/lone'):
+        size = BIG if path == '/big' else LONE
+        length = 'Content-Length: %d\r\n' % size if path == '/lone' else ''
+        conn.sendall(('HTTP/1.0 200 OK\r\nCache-Control: max-age=60\r\n%s\r\n' % length).encode())
+        for _ in range(size >> 16):
+            conn.sendall(b'x' * (1 << 16))
+        conn.close()
+        return
+    body = 'secret for %s\n' % cookie
+    hdrs = HEADERS[path] % cookie if '%s' in HEADERS[path] else HEADERS[path]
+    conn.sendall(('HTTP/1.0 200 OK\r\nContent-Length: %d\r\n%s\r\n%s'
+                  % (len(body), hdrs, body)).encode())
+    conn.close()
+
+def fetch(proxy_port, url, cookie, results, i):
+    s = socket.create_connection(('localhost', proxy_port))
+    s.sendall(('GET %s HTTP/1.0\r\nHost: localhost\r\nCookie: %s\r\n\r\n'
+               % (url, cookie)).encode())
+    data = b''
+    while True:
+        chunk = s.recv(4096)
+        if not chunk:
+            break
+        data += chunk
+    s.close()
+    results[i] = data.decode(errors='replace').split('\r\n\r\n', 1)[-1]
+
+def spliced(proxy, log):
+    """Bodies the proxy has relayed with splice, from its SIGUSR1 stats"""
+    proxy.send_signal(signal.SIGUSR1)
+    time.sleep(0.3)
+    log.seek(0)
+    counts = re.findall(r'^splice: (\d+) bodies', log.read().decode(errors='replace'), re.M)
+    return int(counts[-1]) if counts else -1
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit('usage: %s <proxy binary>' % sys.argv[0])
+    listener = socket.socket()
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind(('localhost', 0))
+    listener.listen(16)
+    origin_port = listener.getsockname()[1]
+    threading.Thread(target=origin, args=(listener,), daemon=True).start()
+
+    proxy_port = free_port()
+    log = tempfile.TemporaryFile()
+    proxy = subprocess.Popen([os.path.abspath(sys.argv[1]), str(proxy_port)],
+                             stdout=log, stderr=subprocess.DEVNULL)
+    failed = 0
+    try:
+        time.sleep(0.5)
+        for path in sorted(HEADERS) + ['/big']:
+            url = 'http://localhost:%d%s' % (origin_port, path)
+            results = [None, None]
+            threads = [threading.Thread(target=fetch, args=(proxy_port, url, who, results, i))
+                       for i, who in enumerate(('alice', 'bob'))]
+            for t in threads:
+                t.start()
+                time.sleep(0.1)     # Alice leads, Bob arrives mid-fetch
+            for t in threads:
+                t.join(10)
+            if path == '/big':
+                ok = results == ['x' * BIG] * 2
+                results = [len(r) if r else r for r in results]
+            else:
+                ok = results == ['secret for alice\n', 'secret for bob\n']
+            failed += not ok
+            print('%s %s: %r' % ('ok  ' if ok else 'FAIL', path, results))
+
+        for path in ('/lone', '/lone-eof'):
+            url = 'http://localhost:%d%s' % (origin_port, path)
+            results = [None]
+            before = spliced(proxy, log)
+            fetch(proxy_port, url, 'alice', results, 0)
+            after = spliced(proxy, log)
+            ok = results[0] == 'x' * LONE and after == before + 1
+            failed += not ok
+            print('%s %s alone: %s bytes, spliced %d -> %d' % ('ok  ' if ok else 'FAIL', path,
+                  len(results[0]) if results[0] else results[0], before, after))
+    finally:
+        proxy.kill()
+        proxy.wait()
+    sys.exit(1 if failed else 0)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,343 @@
+/*
+ * collapse.c - collapsed forwarding and streaming fill of cache misses
+ *
+ *     When many clients miss on the same URL at once, only the first
+ *     (the leader) goes to the origin. The response it relays is also
+ *     appended to a flight: a list of fixed-size segments that grows as
+ *     bytes arrive. Later misses (followers) attach to the flight and
+ *     stream from it while the fetch is still going, so they do not wait
+ *     for the whole download, nor for it to reach the cache.
+ *
+ *     Appended bytes never move, so followers write them out without
+ *     holding the mutex. The leader can declare the response unshareable
+ *     (too big, or framed in a way followers cannot replay); followers
+ *     that have not seen the headers yet then fetch on their own. A body
+ *     that ends at EOF has no size up front, so its followers wait for
+ *     the whole response instead of streaming: if it outgrows FLIGHT_MAX
+ *     the copy is dropped and they fetch on their own, having sent
+ *     nothing yet. A leader with a body too big for the cache asks
+ *     whether anyone attached; if not, it stops sharing and relays the
+ *     rest without a copy.
+ */
+#include "collapse.h"
+
+#define COLLAPSE_BUCKETS 256
+
+enum { FLIGHT_WAIT, FLIGHT_STREAM, FLIGHT_DONE, FLIGHT_NOSHARE, FLIGHT_ABORT };
+
+struct flight {
+    char *key;
+    int state;
+    int whole;                  /* Followers wait for FLIGHT_DONE, not the headers */
+    int linked;                 /* Still in the table for new misses */
+    int refs;                   /* Leader plus attached followers */
+    int waiters;                /* Followers blocked on more */
+    sem_t more;                 /* Posted once per waiter on any change */
+    size_t hdrlen;              /* Valid once FLIGHT_STREAM */
+    size_t len;                 /* Bytes appended so far */
+    char **segs;                /* FLIGHT_SEG bytes each */
+    int nsegs, maxsegs;
+    struct flight *next;
+};
+
+static flight_t *buckets[COLLAPSE_BUCKETS];
+static sem_t mutex;             /* Protects buckets, every flight, and the counters */
+static int inflight;
+static unsigned long leaders, followers, fallbacks, aborted;
+
+static unsigned int hash_key(const char *key)
+{
+    unsigned int h = 5381;
+
+    while (*key)
+        h = h * 33 + (unsigned char)*key++;
+    return h;
+}
+
+/* Wake every follower blocked on f. Caller holds mutex */
+static void wake(flight_t *f)
+{
+    while (f->waiters > 0) {
+        f->waiters--;
+        V(&f->more);
+    }
+}
+
+/* Drop f from the table so new misses on its key start a new flight. Caller holds mutex */
+static void unlink_flight(flight_t *f)
+{
+    flight_t **bp = &buckets[hash_key(f->key) % COLLAPSE_BUCKETS];
+
+    if (!f->linked)
+        return;
+    for (; *bp != f; bp = &(*bp)->next)
+        ;
+    *bp = f->next;
+    f->linked = 0;
+    inflight--;
+}
+
+/* Free the segments once nobody can read them any more. Caller holds mutex */
+static void drop_segs(flight_t *f)
+{
+    int i;
+
+    for (i = 0; i < f->nsegs; i++)
+        Free(f->segs[i]);
+    Free(f->segs);
+    f->segs = NULL;
+    f->nsegs = f->maxsegs = 0;
+}
+
+/* Drop one reference, freeing f with the last one. Caller holds mutex */
+static void put_flight(flight_t *f)
+{
+    if (--f->refs > 0)
+        return;
+    drop_segs(f);
+    Free(f->key);
+    Free(f);
+}
+
+void collapse_init(void)
+{
+    Sem_init(&mutex, 0, 1);
+}
+
+/*
+ * collapse_begin - Call after a cache miss on key. If nobody is fetching
+ *     key yet, sets *leader and returns a new flight that the caller
+ *     fills and ends with collapse_end. Otherwise attaches to the
+ *     running flight; the caller reads it and calls flight_release.
+ */
+flight_t *collapse_begin(char *key, int *leader)
+{
+    flight_t **bp = &buckets[hash_key(key) % COLLAPSE_BUCKETS];
+    flight_t *f;
+
+    P(&mutex);
+    for (f = *bp; f; f = f->next)
+        if (!strcmp(f->key, key))
+            break;
+    if (f) {
+        followers++;
+        f->refs++;
+        V(&mutex);
+        *leader = 0;
+        return f;
+    }
+
+    f = Calloc(1, sizeof(flight_t));
+    f->key = Malloc(strlen(key) + 1);
+    strcpy(f->key, key);
+    f->state = FLIGHT_WAIT;
+    f->linked = 1;
+    f->refs = 1;
+    Sem_init(&f->more, 0, 0);
+    f->next = *bp;
+    *bp = f;
+    inflight++;
+    leaders++;
+    V(&mutex);
+    *leader = 1;
+    return f;
+}
+
+/* Append without the state check. Caller holds mutex */
+static void append(flight_t *f, char *buf, size_t n)
+{
+    size_t off, chunk;
+
+    while (n > 0) {
+        off = f->len % FLIGHT_SEG;
+        if (off == 0 && f->len / FLIGHT_SEG == (size_t)f->nsegs) {
+            if (f->nsegs == f->maxsegs) {
+                f->maxsegs = f->maxsegs ? 2 * f->maxsegs : 4;
+                f->segs = Realloc(f->segs, f->maxsegs * sizeof(char *));
+            }
+            f->segs[f->nsegs++] = Malloc(FLIGHT_SEG);
+        }
+        chunk = FLIGHT_SEG - off;
+        if (chunk > n)
+            chunk = n;
+        memcpy(f->segs[f->len / FLIGHT_SEG] + off, buf, chunk);
+        f->len += chunk;
+        buf += chunk;
+        n -= chunk;
+    }
+}
+
+/*
+ * flight_headers - The leader has the response headers (n bytes ending
+ *     in the blank line, at most FLIGHT_SEG). Followers may start, or
+ *     with whole (the body's size is not known) once it is complete.
+ */
+void flight_headers(flight_t *f, char *hdrs, size_t n, int whole)
+{
+    P(&mutex);
+    if (f->state == FLIGHT_WAIT && n <= FLIGHT_SEG) {
+        append(f, hdrs, n);
+        f->hdrlen = n;
+        f->whole = whole;
+        f->state = FLIGHT_STREAM;
+        wake(f);
+    }
+    V(&mutex);
+}
+
+/*
+ * flight_append - Add n body bytes. Past FLIGHT_MAX the copy is dropped
+ *     unless followers are already streaming a body of known length
+ *     (which the leader only shares up to about FLIGHT_MAX). Returns -1
+ *     when the leader should stop appending.
+ */
+int flight_append(flight_t *f, char *buf, size_t n)
+{
+    P(&mutex);
+    if (f->state != FLIGHT_STREAM) {
+        V(&mutex);
+        return -1;
+    }
+    if (f->len + n > FLIGHT_MAX && (f->refs == 1 || f->whole)) {
+        /* Nobody is reading yet: stop keeping a second copy of a big body, followers fetch alone */
+        f->state = FLIGHT_NOSHARE;
+        unlink_flight(f);
+        drop_segs(f);
+        wake(f);
+        V(&mutex);
+        return -1;
+    }
+    append(f, buf, n);
+    wake(f);
+    V(&mutex);
+    return 0;
+}
+
+/*
+ * flight_noshare - Followers cannot replay this response. Those that
+ *     are still waiting for the headers fetch on their own.
+ */
+void flight_noshare(flight_t *f)
+{
+    P(&mutex);
+    if (f->state == FLIGHT_WAIT) {
+        f->state = FLIGHT_NOSHARE;
+        unlink_flight(f);
+        wake(f);
+    }
+    V(&mutex);
+}
+
+/*
+ * flight_alone - If no follower has attached to f, stop sharing it so
+ *     the leader can relay the rest without keeping a copy; misses on
+ *     its key from now on start their own fetch. Returns 1 if so.
+ */
+int flight_alone(flight_t *f)
+{
+    int alone;
+
+    P(&mutex);
+    if ((alone = f->refs == 1)) {
+        if (f->state == FLIGHT_WAIT || f->state == FLIGHT_STREAM)
+            f->state = FLIGHT_NOSHARE;
+        unlink_flight(f);
+        drop_segs(f);
+    }
+    V(&mutex);
+    return alone;
+}
+
+/*
+ * collapse_end - The leader is done with f. complete says whether the
+ *     whole response arrived; if not, followers that already started
+ *     streaming are cut off.
+ */
+void collapse_end(flight_t *f, int complete)
+{
+    P(&mutex);
+    unlink_flight(f);
+    if (f->state == FLIGHT_STREAM)
+        f->state = complete ? FLIGHT_DONE : FLIGHT_ABORT;
+    else if (f->state == FLIGHT_WAIT)
+        f->state = FLIGHT_NOSHARE;
+    wake(f);
+    put_flight(f);
+    V(&mutex);
+}
+
+/*
+ * flight_wait_headers - Block until the leader has the headers. Returns
+ *     their length, or -1 if the follower has to fetch on its own.
+ */
+ssize_t flight_wait_headers(flight_t *f)
+{
+    ssize_t rc;
+
+    P(&mutex);
+    while (f->state == FLIGHT_WAIT || (f->state == FLIGHT_STREAM && f->whole)) {
+        f->waiters++;
+        V(&mutex);
+        P(&f->more);
+        P(&mutex);
+    }
+    /* A whole flight that failed has not been sent to anyone yet, so it can still be fetched alone */
+    if (f->state == FLIGHT_NOSHARE || (f->state == FLIGHT_ABORT && f->whole)) {
+        fallbacks++;
+        rc = -1;
+    } else {
+        rc = f->hdrlen;
+    }
+    V(&mutex);
+    return rc;
+}
+
+/*
+ * flight_read - Block until there are bytes at off. Sets *data to them
+ *     and returns how many are contiguous, 0 once the response is
+ *     complete, or -1 if the leader failed part way.
+ */
+ssize_t flight_read(flight_t *f, size_t off, char **data)
+{
+    size_t n;
+    ssize_t rc;
+
+    P(&mutex);
+    while (f->len <= off && f->state == FLIGHT_STREAM) {
+        f->waiters++;
+        V(&mutex);
+        P(&f->more);
+        P(&mutex);
+    }
+    if (f->len > off) {
+        n = FLIGHT_SEG - off % FLIGHT_SEG;
+        if (n > f->len - off)
+            n = f->len - off;
+        *data = f->segs[off / FLIGHT_SEG] + off % FLIGHT_SEG;
+        V(&mutex);
+        return n;
+    }
+    rc = f->state == FLIGHT_DONE ? 0 : -1;
+    if (rc < 0)
+        aborted++;
+    V(&mutex);
+    return rc;
+}
+
+void flight_release(flight_t *f)
+{
+    P(&mutex);
+    put_flight(f);
+    V(&mutex);
+}
+
+void collapse_stats(collapse_stats_t *st)
+{
+    P(&mutex);
+    st->inflight = inflight;
+    st->leaders = leaders;
+    st->followers = followers;
+    st->fallbacks = fallbacks;
+    st->aborted = aborted;
+    V(&mutex);
+}
@@ -0,0 +1,42 @@
+/*
+ * collapse.h - collapsed forwarding and streaming fill of cache misses
+ */
+#ifndef __COLLAPSE_H__
+#define __COLLAPSE_H__
+
+#include "csapp.h"
+
+#define FLIGHT_SEG (64 * 1024)  /* Bytes per segment of an in-flight response */
+#define FLIGHT_MAX (4 << 20)    /* Most a flight buffers; past it followers
+                                   of a body that ends at EOF fetch alone */
+
+/* A response being fetched by one thread (the leader) and read by others */
+typedef struct flight flight_t;
+
+/* Snapshot of the counters returned by collapse_stats */
+typedef struct {
+    int inflight;             /* Keys being fetched right now */
+    unsigned long leaders;    /* Misses that went to the origin */
+    unsigned long followers;  /* Misses that attached to a leader */
+    unsigned long fallbacks;  /* Followers that had to fetch alone */
+    unsigned long aborted;    /* Followers cut off by a failed fetch */
+} collapse_stats_t;
+
+void collapse_init(void);
+flight_t *collapse_begin(char *key, int *leader);
+void collapse_end(flight_t *f, int complete);
+
+/* Leader side */
+void flight_headers(flight_t *f, char *hdrs, size_t n, int whole);
+int flight_append(flight_t *f, char *buf, size_t n);
+void flight_noshare(flight_t *f);
+int flight_alone(flight_t *f);
+
+/* Follower side */
+ssize_t flight_wait_headers(flight_t *f);
+ssize_t flight_read(flight_t *f, size_t off, char **data);
+void flight_release(flight_t *f);
+
+void collapse_stats(collapse_stats_t *st);
+
+#endif /* __COLLAPSE_H__ */
@@ -0,0 +1,168 @@
+/*
+ * connpool.c - pool of idle persistent connections to origin servers
+ *
+ *     Connections are parked per host:port in a small hash table after a
+ *     response has been fully read, and handed back out (most recently
+ *     parked first) for the next request to the same origin. Every
+ *     connection is checked for liveness before it is reused, since the
+ *     origin may have closed it while it sat idle.
+ */
+#include "connpool.h"
+
+#define POOL_BUCKETS 64
+
+typedef struct idle_conn {
+    int fd;
+    time_t since;               /* When it was parked */
+    struct idle_conn *next;
+} idle_conn_t;
+
+typedef struct pool_host {
+    char *key;                  /* "host:port", host lowercased */
+    int nidle;
+    idle_conn_t *idle;          /* Most recently parked first */
+    struct pool_host *next;
+} pool_host_t;
+
+static pool_host_t *buckets[POOL_BUCKETS];
+static sem_t mutex;             /* Protects buckets and the counters below */
+static int max_idle, max_per_host, idle_secs;
+static int total_idle;
+static unsigned long reused, missed, stale, parked, dropped;
+
+static unsigned int hash_key(const char *key)
+{
+    unsigned int h = 5381;
+
+    while (*key)
+        h = h * 33 + (unsigned char)*key++;
+    return h;
+}
+
+static void make_key(char *key, size_t len, char *host, int port)
+{
+    size_t i;
+
+    snprintf(key, len, "%s:%d", host, port);
+    for (i = 0; key[i]; i++)
+        key[i] = tolower((unsigned char)key[i]);
+}
+
+/* Find the entry for key, creating it if create is set. Caller holds mutex */
+static pool_host_t *find_host(const char *key, int create)
+{
+    pool_host_t **bp = &buckets[hash_key(key) % POOL_BUCKETS];
+    pool_host_t *h;
+
+    for (h = *bp; h; h = h->next)
+        if (!strcmp(h->key, key))
+            return h;
+    if (!create)
+        return NULL;
+    h = Calloc(1, sizeof(pool_host_t));
+    h->key = Malloc(strlen(key) + 1);
+    strcpy(h->key, key);
+    h->next = *bp;
+    *bp = h;
+    return h;
+}
+
+/*
+ * conn_alive - An idle HTTP connection must have nothing to read. EOF
+ *     means the origin closed it; unexpected bytes or an error mean it
+ *     is out of sync. Either way it cannot be reused.
+ */
+static int conn_alive(int fd)
+{
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void connpool_init(int max_idle_arg, int max_per_host_arg, int idle_secs_arg)
+{
+    Sem_init(&mutex, 0, 1);
+    max_idle = max_idle_arg;
+    max_per_host = max_per_host_arg;
+    idle_secs = idle_secs_arg;
+}
+
+/*
+ * connpool_get - Return a live idle connection to host:port, or -1 if
+ *     there is none and the caller has to connect.
+ */
+int connpool_get(char *host, int port)
+{
+    char key[MAXLINE];
+    pool_host_t *h;
+    idle_conn_t *ic;
+    time_t now = time(NULL);
+    int fd;
+
+    make_key(key, sizeof(key), host, port);
+    P(&mutex);
+    if ((h = find_host(key, 0)) != NULL) {
+        while ((ic = h->idle) != NULL) {
+            h->idle = ic->next;
+            h->nidle--;
+            total_idle--;
+            fd = ic->fd;
+            if (now - ic->since <= idle_secs && conn_alive(fd)) {
+                reused++;
+                V(&mutex);
+                Free(ic);
+                return fd;
+            }
+            stale++;
+            close(fd);
+            Free(ic);
+        }
+    }
+    missed++;
+    V(&mutex);
+    return -1;
+}
+
+/*
+ * connpool_put - Park fd for reuse with host:port. The caller must only
+ *     pass a connection whose last response was read to the end. If a
+ *     limit is reached the connection is closed instead.
+ */
+void connpool_put(char *host, int port, int fd)
+{
+    char key[MAXLINE];
+    pool_host_t *h;
+    idle_conn_t *ic;
+
+    make_key(key, sizeof(key), host, port);
+    P(&mutex);
+    h = find_host(key, 1);
+    if (total_idle >= max_idle || h->nidle >= max_per_host) {
+        dropped++;
+        V(&mutex);
+        close(fd);
+        return;
+    }
+    ic = Malloc(sizeof(idle_conn_t));
+    ic->fd = fd;
+    ic->since = time(NULL);
+    ic->next = h->idle;
+    h->idle = ic;
+    h->nidle++;
+    total_idle++;
+    parked++;
+    V(&mutex);
+}
+
+void connpool_stats(connpool_stats_t *st)
+{
+    P(&mutex);
+    st->idle = total_idle;
+    st->reused = reused;
+    st->missed = missed;
+    st->stale = stale;
+    st->parked = parked;
+    st->dropped = dropped;
+    V(&mutex);
+}
@@ -0,0 +1,28 @@
+/*
+ * connpool.h - pool of idle persistent connections to origin servers
+ */
+#ifndef __CONNPOOL_H__
+#define __CONNPOOL_H__
+
+#include "csapp.h"
+
+#define POOL_MAX_IDLE 64      /* Idle connections kept across all hosts */
+#define POOL_MAX_PER_HOST 8   /* Idle connections kept per host:port */
+#define POOL_IDLE_SECS 30     /* Close idle connections older than this */
+
+/* Snapshot of the pool counters returned by connpool_stats */
+typedef struct {
+    int idle;                 /* Connections currently parked */
+    unsigned long reused;     /* connpool_get handed out a live connection */
+    unsigned long missed;     /* connpool_get found nothing usable */
+    unsigned long stale;      /* Parked connections found dead or expired */
+    unsigned long parked;     /* connpool_put kept the connection */
+    unsigned long dropped;    /* connpool_put closed it because of a limit */
+} connpool_stats_t;
+
+void connpool_init(int max_idle, int max_per_host, int idle_secs);
+int connpool_get(char *host, int port);
+void connpool_put(char *host, int port, int fd);
+void connpool_stats(connpool_stats_t *st);
+
+#endif /* __CONNPOOL_H__ */
@@ -864,6 +864,30 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 /* $end rio_readnb */
 
+/*
+ * rio_readsomeb - Read up to n bytes (buffered), but never wait for more
+ *     than one read. Bytes already in the internal buffer are returned
+ *     first; otherwise the read goes straight into usrbuf so large
+ *     transfers are not chopped into RIO_BUFSIZE pieces.
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n)
+{
+    ssize_t cnt;
+
+    if (rp->rio_cnt > 0) {
+        cnt = rp->rio_cnt < n ? rp->rio_cnt : n;
+        memcpy(usrbuf, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        return cnt;
+    }
+    while ((cnt = read(rp->rio_fd, usrbuf, n)) < 0) {
+        if (errno != EINTR) /* Interrupted by sig handler return */
+            return -1;
+    }
+    return cnt;
+}
+
 /* 
  * rio_readlineb - Robustly read a text line (buffered)
  */
@@ -925,6 +949,15 @@ ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n)
     return rc;
 }
 
+ssize_t Rio_readsomeb(rio_t *rp, void *usrbuf, size_t n)
+{
+    ssize_t rc;
+
+    if ((rc = rio_readsomeb(rp, usrbuf, n)) < 0)
+	unix_error("Rio_readsomeb error");
+    return rc;
+}
+
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
     ssize_t rc;
@@ -949,7 +982,7 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, char *port) {
     int clientfd, rc;
-    struct addrinfo hints, *listp, *p;
+    struct addrinfo hints, *listp;
 
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -961,29 +994,143 @@ int open_clientfd(char *hostname, char *port) {
         return -2;
     }
   
-    /* Walk the list for one that we can successfully connect to */
+    /* Race the addresses instead of waiting out each one in turn */
+    clientfd = connect_addrs(listp, 0);
+
+    /* Clean up */
+    freeaddrinfo(listp);
+    return clientfd;
+}
+/* $end open_clientfd */
+
+/*
+ * connect_addrs - Connect to one of the addresses in listp, Happy
+ *     Eyeballs style (RFC 8305). Addresses are reordered so the two
+ *     families alternate, starting with the family of the first one.
+ *     A non-blocking connect is started on the first address, and
+ *     every CONNECT_STAGGER_MS, or as soon as an attempt fails, another
+ *     one is started without giving up on the earlier ones. The first
+ *     attempt to complete wins and the rest are closed. A timeout_ms
+ *     of 0 or less means no deadline.
+ *
+ *     Returns a blocking connected descriptor, or -1 with errno set
+ *     (ETIMEDOUT when the deadline passed).
+ */
+/* $begin connect_addrs */
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+int connect_addrs(struct addrinfo *listp, int timeout_ms)
+{
+    struct addrinfo *order[CONNECT_MAX_ADDRS], *first[CONNECT_MAX_ADDRS];
+    struct addrinfo *other[CONNECT_MAX_ADDRS], *p;
+    struct pollfd pfd[CONNECT_MAX_ADDRS];
+    int naddrs = 0, nfirst = 0, nother = 0, npending = 0, next = 0;
+    int fd = -1, i, j, rc, err, last_err = ECONNREFUSED, wait;
+    socklen_t errlen;
+    long now, deadline, next_start;
+
+    /* Interleave the address families */
     for (p = listp; p; p = p->ai_next) {
-        /* Create a socket descriptor */
-        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
-            continue; /* Socket failed, try the next */
+        if (p->ai_family == listp->ai_family && nfirst < CONNECT_MAX_ADDRS)
+            first[nfirst++] = p;
+        else if (p->ai_family != listp->ai_family && nother < CONNECT_MAX_ADDRS)
+            other[nother++] = p;
+    }
+    for (i = 0, j = 0; (i < nfirst || j < nother) && naddrs < CONNECT_MAX_ADDRS; ) {
+        if (i < nfirst)
+            order[naddrs++] = first[i++];
+        if (j < nother && naddrs < CONNECT_MAX_ADDRS)
+            order[naddrs++] = other[j++];
+    }
 
-        /* Connect to the server */
-        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) 
-            break; /* Success */
-        if (close(clientfd) < 0) { /* Connect failed, try another */  //line:netp:openclientfd:closefd
-            fprintf(stderr, "open_clientfd: close failed: %s\n", strerror(errno));
+    now = now_ms();
+    deadline = timeout_ms > 0 ? now + timeout_ms : 0;
+    next_start = now;
+    while (1) {
+        /* Start the next attempt if it is due */
+        if (next < naddrs && (npending == 0 || now >= next_start)) {
+            p = order[next++];
+            next_start = now + CONNECT_STAGGER_MS;
+            if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0) {
+                last_err = errno;
+                continue;
+            }
+            if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+                break;  /* Connected at once (e.g. loopback) */
+            if (errno != EINPROGRESS) {
+                last_err = errno;
+                close(fd);
+                fd = -1;
+                continue;
+            }
+            pfd[npending].fd = fd;
+            pfd[npending].events = POLLOUT;
+            npending++;
+            fd = -1;
+        }
+        if (npending == 0) {  /* Nothing left to try */
+            errno = last_err;
             return -1;
-        } 
-    } 
+        }
 
-    /* Clean up */
-    freeaddrinfo(listp);
-    if (!p) /* All connects failed */
+        /* Wait until an attempt finishes, the next one is due, or the deadline */
+        wait = -1;
+        if (next < naddrs)
+            wait = next_start - now;
+        if (deadline && (wait < 0 || deadline - now < wait))
+            wait = deadline - now;
+        if (wait < 0 && (next < naddrs || deadline))
+            wait = 0;
+        if ((rc = poll(pfd, npending, wait)) < 0 && errno != EINTR) {
+            last_err = errno;
+            break;
+        }
+        for (i = 0; rc > 0 && i < npending; ) {
+            if (pfd[i].revents == 0) {
+                i++;
+                continue;
+            }
+            err = 0;
+            errlen = sizeof(err);
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+                err = errno;
+            if (err == 0) {
+                fd = pfd[i].fd;
+                pfd[i] = pfd[--npending];
+                break;
+            }
+            /* Failed: drop it and start the next attempt right away */
+            last_err = err;
+            close(pfd[i].fd);
+            pfd[i] = pfd[--npending];
+            next_start = 0;
+        }
+        if (fd >= 0)
+            break;
+        now = now_ms();
+        if (deadline && now >= deadline) {
+            last_err = ETIMEDOUT;
+            break;
+        }
+    }
+
+    /* Close the attempts that lost */
+    for (i = 0; i < npending; i++)
+        close(pfd[i].fd);
+    if (fd < 0) {
+        errno = last_err;
         return -1;
-    else    /* The last connect succeeded */
-        return clientfd;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
 }
-/* $end open_clientfd */
+/* $end connect_addrs */
 
 /*  
  * open_listenfd - Open and return a listening socket on port. This
@@ -994,7 +1141,24 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
+static int open_listenfd_opt(char *port, int reuseport);
+
 int open_listenfd(char *port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+
+/*
+ * open_listenfd_reuseport - Like open_listenfd, but sets SO_REUSEPORT
+ *     so several sockets can listen on the same port. The kernel then
+ *     spreads incoming connections across them.
+ */
+int open_listenfd_reuseport(char *port)
+{
+    return open_listenfd_opt(port, 1);
+}
+
+static int open_listenfd_opt(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1018,6 +1182,11 @@ int open_listenfd(char *port)
         /* Eliminates "Address already in use" error from bind */
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
 
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -1064,6 +1233,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_reuseport(char *port)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
@@ -0,0 +1,266 @@
+/*
+ * deflate.c - small built-in gzip codec for cached bodies
+ *
+ *     Compression is single-pass LZ77 (one hash probe per position,
+ *     greedy matches of 4 to 258 bytes within a 32 KB window) coded
+ *     as one deflate block with the fixed Huffman codes (RFC 1951
+ *     3.2.6), wrapped in a gzip member (RFC 1952). That trades some
+ *     ratio against zlib for a codec with no tables to build per call,
+ *     and its output is real gzip, so it can be sent unchanged to
+ *     clients that accept it. The decoder only handles what the
+ *     encoder writes: one final fixed-Huffman block.
+ */
+#include "deflate.h"
+
+#define HASH_BITS 14
+#define WINDOW 32768
+#define MIN_MATCH 4
+#define MAX_MATCH 258
+
+static const unsigned short len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const unsigned char len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const unsigned short dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const unsigned char dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* Built once by init_tables */
+static unsigned short lit_code[288];    /* Fixed codes, bit reversed for LSB-first output */
+static unsigned char lit_bits[288];
+static unsigned char dist_code[30];
+static unsigned char len_sym[MAX_MATCH + 1];    /* Match length -> length symbol - 257 */
+static unsigned char dist_sym[WINDOW + 1];      /* Distance -> distance symbol */
+static unsigned short lit_table[512];   /* Next 9 input bits -> symbol << 4 | code length */
+static unsigned char dist_table[32];    /* Next 5 input bits -> distance symbol */
+static unsigned int crc_table[256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static unsigned int reverse(unsigned int code, int len)
+{
+    unsigned int r = 0;
+
+    while (len-- > 0) {
+        r = (r << 1) | (code & 1);
+        code >>= 1;
+    }
+    return r;
+}
+
+static void init_tables(void)
+{
+    unsigned int c, code;
+    int sym, len, s, j;
+
+    for (sym = 0; sym < 288; sym++) {
+        if (sym < 144)
+            code = 0x30 + sym, len = 8;
+        else if (sym < 256)
+            code = 0x190 + sym - 144, len = 9;
+        else if (sym < 280)
+            code = sym - 256, len = 7;
+        else
+            code = 0xc0 + sym - 280, len = 8;
+        lit_code[sym] = reverse(code, len);
+        lit_bits[sym] = len;
+        for (j = lit_code[sym]; j < 512; j += 1 << len)
+            lit_table[j] = sym << 4 | len;
+    }
+    for (s = 0; s < 30; s++) {
+        dist_code[s] = reverse(s, 5);
+        dist_table[dist_code[s]] = s;
+    }
+    dist_table[reverse(30, 5)] = dist_table[reverse(31, 5)] = 30;     /* Invalid */
+    for (s = 0, len = 3; len <= MAX_MATCH; len++) {
+        while (s < 28 && len >= len_base[s + 1])
+            s++;
+        len_sym[len] = s;
+    }
+    for (s = 0, j = 1; j <= WINDOW; j++) {
+        while (s < 29 && j >= dist_base[s + 1])
+            s++;
+        dist_sym[j] = s;
+    }
+    for (j = 0; j < 256; j++) {
+        for (c = j, s = 0; s < 8; s++)
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crc_table[j] = c;
+    }
+}
+
+static unsigned int crc32(const unsigned char *p, size_t n)
+{
+    unsigned int c = 0xffffffffu;
+
+    while (n-- > 0)
+        c = crc_table[(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffffu;
+}
+
+/* LSB-first bit writer into a fixed buffer */
+typedef struct {
+    unsigned char *out;
+    size_t pos, cap;
+    unsigned long bits;
+    int nbits;
+} bitw_t;
+
+static void put_bits(bitw_t *w, unsigned int v, int n)
+{
+    w->bits |= (unsigned long)v << w->nbits;
+    w->nbits += n;
+    while (w->nbits >= 8) {
+        if (w->pos < w->cap)
+            w->out[w->pos] = w->bits & 0xff;
+        w->pos++;
+        w->bits >>= 8;
+        w->nbits -= 8;
+    }
+}
+
+static void put_le32(bitw_t *w, unsigned int v)
+{
+    put_bits(w, v & 0xffff, 16);
+    put_bits(w, v >> 16, 16);
+}
+
+static unsigned int load32(const unsigned char *p)
+{
+    unsigned int v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+#define HASH(p) ((load32(p) * 2654435761u) >> (32 - HASH_BITS))
+
+/*
+ * gz_compress - Compress in[0..n) into a gzip member in out. Returns its
+ *     length, or 0 if it would not fit in cap bytes (so the caller can
+ *     ask for a minimum saving by passing a smaller cap than n).
+ */
+size_t gz_compress(const char *in, size_t n, char *out, size_t cap)
+{
+    static const unsigned char gz_header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    const unsigned char *src = (const unsigned char *)in;
+    int head[1 << HASH_BITS];
+    size_t i = 0, len, k;
+    bitw_t w;
+    long cand;
+    int s;
+
+    pthread_once(&tables_once, init_tables);
+    if (cap < GZ_OVERHEAD)
+        return 0;
+    memcpy(out, gz_header, sizeof(gz_header));
+    w.out = (unsigned char *)out;
+    w.pos = sizeof(gz_header);
+    w.cap = cap;
+    w.bits = 0;
+    w.nbits = 0;
+    memset(head, -1, sizeof(head));
+
+    put_bits(&w, 1 | 1 << 1, 3);        /* BFINAL, BTYPE 01 (fixed Huffman) */
+    while (i + MIN_MATCH <= n && w.pos < cap) {
+        unsigned int h = HASH(src + i);
+
+        cand = head[h];
+        head[h] = i;
+        if (cand >= 0 && i - cand <= WINDOW && load32(src + cand) == load32(src + i)) {
+            for (len = MIN_MATCH; len < MAX_MATCH && i + len < n && src[cand + len] == src[i + len]; len++)
+                ;
+            s = len_sym[len];
+            put_bits(&w, lit_code[257 + s], lit_bits[257 + s]);
+            put_bits(&w, len - len_base[s], len_extra[s]);
+            s = dist_sym[i - cand];
+            put_bits(&w, dist_code[s], 5);
+            put_bits(&w, i - cand - dist_base[s], dist_extra[s]);
+            for (k = 1; k < len && i + k + MIN_MATCH <= n; k++)
+                head[HASH(src + i + k)] = i + k;
+            i += len;
+        } else {
+            put_bits(&w, lit_code[src[i]], lit_bits[src[i]]);
+            i++;
+        }
+    }
+    for (; i < n && w.pos < cap; i++)
+        put_bits(&w, lit_code[src[i]], lit_bits[src[i]]);
+    put_bits(&w, lit_code[256], lit_bits[256]);
+    put_bits(&w, 0, (8 - w.nbits) & 7);
+    put_le32(&w, crc32(src, n));
+    put_le32(&w, n);
+    return w.pos <= cap ? w.pos : 0;
+}
+
+/*
+ * gz_decompress - Expand a member written by gz_compress into out,
+ *     which must hold exactly rawlen bytes. 0 on success, -1 if the
+ *     input is not such a member or does not expand to rawlen bytes.
+ */
+int gz_decompress(const char *in, size_t n, char *out, size_t rawlen)
+{
+    const unsigned char *p = (const unsigned char *)in + 10, *end;
+    unsigned long bits = 0;
+    size_t o = 0, len, dist;
+    int nbits = 0, sym;
+
+    pthread_once(&tables_once, init_tables);
+    if (n < GZ_OVERHEAD || memcmp(in, "\x1f\x8b\x08\x00", 4) != 0)
+        return -1;
+    end = (const unsigned char *)in + n - 8;
+
+/* Past the end the stream reads as zeros, which decode to end-of-block */
+#define NEED(k) while (nbits < (k)) { bits |= (unsigned long)(p < end ? *p++ : 0) << nbits; nbits += 8; }
+#define TAKE(k, v) do { NEED(k); (v) = bits & ((1UL << (k)) - 1); bits >>= (k); nbits -= (k); } while (0)
+
+    TAKE(3, sym);
+    if (sym != (1 | 1 << 1))
+        return -1;
+    while (1) {
+        NEED(9);
+        sym = lit_table[bits & 511];
+        bits >>= sym & 15;
+        nbits -= sym & 15;
+        sym >>= 4;
+        if (sym < 256) {
+            if (o >= rawlen)
+                return -1;
+            out[o++] = sym;
+            continue;
+        }
+        if (sym == 256)
+            break;
+        if ((sym -= 257) >= 29)
+            return -1;
+        TAKE(len_extra[sym], len);
+        len += len_base[sym];
+        TAKE(5, sym);
+        if ((sym = dist_table[sym]) >= 30)
+            return -1;
+        TAKE(dist_extra[sym], dist);
+        dist += dist_base[sym];
+        if (dist > o || len > rawlen - o)
+            return -1;
+        if (dist >= len) {
+            memcpy(out + o, out + o - dist, len);
+            o += len;
+        } else {
+            for (; len > 0; len--, o++)       /* Overlapping: a run */
+                out[o] = out[o - dist];
+        }
+    }
+#undef NEED
+#undef TAKE
+    if (o != rawlen || load32(end + 4) != (unsigned int)rawlen)
+        return -1;
+    return 0;
+}
@@ -0,0 +1,14 @@
+/*
+ * deflate.h - small built-in gzip codec for cached bodies
+ */
+#ifndef __DEFLATE_H__
+#define __DEFLATE_H__
+
+#include "csapp.h"
+
+#define GZ_OVERHEAD 18          /* gzip header and trailer bytes */
+
+size_t gz_compress(const char *in, size_t n, char *out, size_t cap);
+int gz_decompress(const char *in, size_t n, char *out, size_t rawlen);
+
+#endif /* __DEFLATE_H__ */
@@ -0,0 +1,323 @@
+/*
+ * diskcache.c - on-disk second tier behind the in-memory web object cache
+ *
+ *     Objects evicted from memory are appended as records to large
+ *     segment files (DISK_SEG_SIZE each) that stay mapped with mmap, so
+ *     writes and reads are plain copies to and from the page cache. An
+ *     in-memory hash index maps each URL to its newest record; replaced
+ *     or dropped records are just forgotten by the index and count as
+ *     dead space in their segment. The tier is log structured: one
+ *     segment takes appends, and when it fills the next free one does.
+ *     One segment is always kept free for compaction, which reclaims
+ *     the sealed segment with the fewest live bytes by copying its live
+ *     records forward into at most half of the new active segment; any
+ *     that do not fit are dropped, which is how the tier evicts. The
+ *     number of segments is the byte budget.
+ */
+#include "diskcache.h"
+
+#define DISK_MAGIC 0x44534b31u        /* "DSK1" */
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+/* Record header. The URL (with its NUL), headers and body follow */
+typedef struct {
+    unsigned int magic, hash;
+    unsigned int urllen, hdrlen, bodylen;
+    unsigned int rawlen;
+    time_t expires, ttl, deadline;
+    unsigned long cost_us;
+} rec_t;
+
+enum { SEG_FREE, SEG_ACTIVE, SEG_SEALED };
+
+typedef struct {
+    char *base;                 /* DISK_SEG_SIZE bytes mapped from the file */
+    size_t used;                /* Bytes appended so far */
+    size_t live;                /* Bytes of records the index points to */
+    int state;
+} seg_t;
+
+typedef struct disk_entry {
+    unsigned int hash;
+    int seg;
+    size_t off, len;
+    struct disk_entry *next;
+} disk_entry_t;
+
+static sem_t mutex;             /* Protects everything below */
+static int enabled;
+static seg_t *segs;
+static int nsegs, nfree, active;
+static disk_entry_t **buckets;
+static unsigned int nbuckets;   /* Power of two */
+static int nentries;
+static size_t live_bytes;
+static unsigned long hits, misses, writes, compactions, relocated, dropped;
+
+static rec_t *rec_at(int seg, size_t off)
+{
+    return (rec_t *)(segs[seg].base + off);
+}
+
+static char *rec_url(rec_t *r)
+{
+    return (char *)(r + 1);
+}
+
+/* Link to the index entry for url, or to the NULL that ends its chain. Caller holds mutex */
+static disk_entry_t **find(const char *url, unsigned int hash)
+{
+    disk_entry_t **ep, *e;
+
+    for (ep = &buckets[hash & (nbuckets - 1)]; (e = *ep) != NULL; ep = &e->next)
+        if (e->hash == hash && !strcmp(url, rec_url(rec_at(e->seg, e->off))))
+            break;
+    return ep;
+}
+
+static void unlink_entry(disk_entry_t **ep)
+{
+    disk_entry_t *e = *ep;
+
+    *ep = e->next;
+    segs[e->seg].live -= e->len;
+    live_bytes -= e->len;
+    nentries--;
+    Free(e);
+}
+
+/*
+ * compact - Reclaim the sealed segment with the fewest live bytes. Its
+ *     live records are copied to the (fresh) active segment until they
+ *     fill half of it, so appends keep the other half; the rest are
+ *     dropped. Caller holds mutex.
+ */
+static void compact(void)
+{
+    disk_entry_t **ep, *e;
+    seg_t *a = &segs[active];
+    size_t off, len;
+    int i, victim = -1;
+    rec_t *r;
+
+    for (i = 0; i < nsegs; i++)
+        if (segs[i].state == SEG_SEALED && (victim < 0 || segs[i].live < segs[victim].live))
+            victim = i;
+    if (victim < 0)
+        return;
+    for (off = 0; off < segs[victim].used; off += len) {
+        r = rec_at(victim, off);
+        len = ALIGN8(sizeof(rec_t) + r->urllen + r->hdrlen + r->bodylen);
+        e = *(ep = find(rec_url(r), r->hash));
+        if (e == NULL || e->seg != victim || e->off != off)
+            continue;                   /* Dead record */
+        if (a->used + len <= DISK_SEG_SIZE / 2) {
+            memcpy(a->base + a->used, r, len);
+            segs[victim].live -= len;
+            e->seg = active;
+            e->off = a->used;
+            a->used += len;
+            a->live += len;
+            relocated++;
+        } else {
+            unlink_entry(ep);
+            dropped++;
+        }
+    }
+    segs[victim].state = SEG_FREE;
+    segs[victim].used = segs[victim].live = 0;
+    nfree++;
+    compactions++;
+}
+
+/* Make room for len bytes in the active segment. Caller holds mutex */
+static void reserve(size_t len)
+{
+    int i;
+
+    if (segs[active].used + len <= DISK_SEG_SIZE)
+        return;
+    segs[active].state = SEG_SEALED;
+    for (i = 0; segs[i].state != SEG_FREE; i++)
+        ;
+    segs[i].state = SEG_ACTIVE;
+    active = i;
+    /* The last free segment is the compaction reserve: refill it right away */
+    if (--nfree == 0)
+        compact();
+}
+
+/*
+ * diskcache_init - Create nsegs segment files in dir, which is made if
+ *     needed, for a budget of max_bytes. Existing segments are discarded.
+ */
+void diskcache_init(const char *dir, size_t max_bytes)
+{
+    char path[MAXLINE];
+    int i, fd;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        unix_error("diskcache_init mkdir error");
+    nsegs = max_bytes / DISK_SEG_SIZE;
+    if (nsegs < DISK_MIN_SEGS)
+        nsegs = DISK_MIN_SEGS;
+    segs = Calloc(nsegs, sizeof(seg_t));
+    for (i = 0; i < nsegs; i++) {
+        snprintf(path, sizeof(path), "%s/seg.%03d", dir, i);
+        fd = Open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        /* Allocate the blocks now: a full disk would otherwise be a SIGBUS on first touch */
+        if ((errno = posix_fallocate(fd, 0, DISK_SEG_SIZE)) != 0)
+            unix_error("diskcache_init fallocate error");
+        segs[i].base = Mmap(NULL, DISK_SEG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        Close(fd);
+        segs[i].state = SEG_FREE;
+    }
+    segs[0].state = SEG_ACTIVE;
+    active = 0;
+    nfree = nsegs - 1;
+
+    for (nbuckets = 256; nbuckets < max_bytes / 4096; nbuckets <<= 1)
+        ;
+    buckets = Calloc(nbuckets, sizeof(disk_entry_t *));
+    Sem_init(&mutex, 0, 1);
+    enabled = 1;
+}
+
+int diskcache_enabled(void)
+{
+    return enabled;
+}
+
+/*
+ * diskcache_put - Store an object evicted from memory. If the tier
+ *     already has the URL (the object was read back from disk), only its
+ *     freshness is updated. Objects over half a segment are not stored.
+ */
+void diskcache_put(unsigned int hash, const disk_item_t *it)
+{
+    size_t urllen = strlen(it->url) + 1;
+    size_t len = ALIGN8(sizeof(rec_t) + urllen + it->hdrlen + it->bodylen);
+    disk_entry_t *e;
+    char *p;
+    rec_t *r;
+
+    if (!enabled || len > DISK_SEG_SIZE / 2)
+        return;
+    P(&mutex);
+    if ((e = *find(it->url, hash)) != NULL) {
+        r = rec_at(e->seg, e->off);
+        r->expires = it->expires;
+        r->ttl = it->ttl;
+        r->deadline = it->deadline;
+        V(&mutex);
+        return;
+    }
+    reserve(len);
+    r = rec_at(active, segs[active].used);
+    r->magic = DISK_MAGIC;
+    r->hash = hash;
+    r->urllen = urllen;
+    r->hdrlen = it->hdrlen;
+    r->bodylen = it->bodylen;
+    r->rawlen = it->rawlen;
+    r->expires = it->expires;
+    r->ttl = it->ttl;
+    r->deadline = it->deadline;
+    r->cost_us = it->cost_us;
+    p = rec_url(r);
+    memcpy(p, it->url, urllen);
+    memcpy(p + urllen, it->hdrs, it->hdrlen);
+    if (it->bodylen > 0)
+        memcpy(p + urllen + it->hdrlen, it->body, it->bodylen);
+
+    e = Malloc(sizeof(disk_entry_t));
+    e->hash = hash;
+    e->seg = active;
+    e->off = segs[active].used;
+    e->len = len;
+    e->next = buckets[hash & (nbuckets - 1)];
+    buckets[hash & (nbuckets - 1)] = e;
+    segs[active].used += len;
+    segs[active].live += len;
+    live_bytes += len;
+    nentries++;
+    writes++;
+    V(&mutex);
+}
+
+/*
+ * diskcache_get - Copy url's object out of the tier. The block returned
+ *     comes from alloc, with room bytes free at the front for the caller, then
+ *     the URL, headers and body, which it points into. NULL if the tier
+ *     does not have it or it is past its deadline.
+ */
+void *diskcache_get(const char *url, unsigned int hash, size_t room, void *(*alloc)(size_t), disk_item_t *it)
+{
+    disk_entry_t **ep, *e;
+    char *block = NULL, *p;
+    rec_t *r;
+
+    if (!enabled)
+        return NULL;
+    P(&mutex);
+    if ((e = *(ep = find(url, hash))) != NULL && rec_at(e->seg, e->off)->deadline <= time(NULL)) {
+        unlink_entry(ep);
+        e = NULL;
+    }
+    if (e == NULL) {
+        misses++;
+        V(&mutex);
+        return NULL;
+    }
+    r = rec_at(e->seg, e->off);
+    block = alloc(room + r->urllen + r->hdrlen + r->bodylen);
+    memcpy(block + room, rec_url(r), r->urllen + r->hdrlen + r->bodylen);
+    p = block + room;
+    it->url = p;
+    it->hdrs = p + r->urllen;
+    it->hdrlen = r->hdrlen;
+    it->body = r->bodylen > 0 ? it->hdrs + r->hdrlen : NULL;
+    it->bodylen = r->bodylen;
+    it->rawlen = r->rawlen;
+    it->expires = r->expires;
+    it->ttl = r->ttl;
+    it->deadline = r->deadline;
+    it->cost_us = r->cost_us;
+    hits++;
+    V(&mutex);
+    return block;
+}
+
+/* Forget url, e.g. because a newer copy was fetched */
+void diskcache_remove(const char *url, unsigned int hash)
+{
+    disk_entry_t **ep;
+
+    if (!enabled)
+        return;
+    P(&mutex);
+    if (*(ep = find(url, hash)) != NULL)
+        unlink_entry(ep);
+    V(&mutex);
+}
+
+void diskcache_stats(diskcache_stats_t *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (!enabled)
+        return;
+    P(&mutex);
+    st->enabled = 1;
+    st->entries = nentries;
+    st->segments = nsegs;
+    st->free_segs = nfree;
+    st->live_bytes = live_bytes;
+    st->max_bytes = (size_t)nsegs * DISK_SEG_SIZE;
+    st->hits = hits;
+    st->misses = misses;
+    st->writes = writes;
+    st->compactions = compactions;
+    st->relocated = relocated;
+    st->dropped = dropped;
+    V(&mutex);
+}
@@ -0,0 +1,48 @@
+/*
+ * diskcache.h - on-disk second tier behind the in-memory web object cache
+ */
+#ifndef __DISKCACHE_H__
+#define __DISKCACHE_H__
+
+#include "csapp.h"
+
+#define DISK_SEG_SIZE (4 << 20)       /* Bytes per segment file */
+#define DISK_MAX_BYTES (64 << 20)     /* Default budget for all segments */
+#define DISK_MIN_SEGS 3               /* Active, compaction reserve and one more */
+
+/* An object as the tier stores it. Pointers are into a block owned by the caller */
+typedef struct {
+    char *url;                /* NUL terminated */
+    char *hdrs;
+    size_t hdrlen;
+    char *body;               /* NULL if bodylen is 0 */
+    size_t bodylen;
+    size_t rawlen;            /* Body length before compression */
+    time_t expires, ttl;      /* Freshness, as in cache_obj */
+    time_t deadline;          /* Dropped after this */
+    unsigned long cost_us;    /* Origin fetch time */
+} disk_item_t;
+
+/* Snapshot of the counters returned by diskcache_stats */
+typedef struct {
+    int enabled;
+    int entries;              /* Objects indexed */
+    int segments, free_segs;
+    size_t live_bytes;        /* Bytes of records still indexed */
+    size_t max_bytes;
+    unsigned long hits;       /* Found on disk */
+    unsigned long misses;     /* Asked for and not there */
+    unsigned long writes;     /* Records appended for evicted objects */
+    unsigned long compactions;/* Segments reclaimed */
+    unsigned long relocated;  /* Live records copied forward by compaction */
+    unsigned long dropped;    /* Live records given up to reclaim space */
+} diskcache_stats_t;
+
+void diskcache_init(const char *dir, size_t max_bytes);
+int diskcache_enabled(void);
+void diskcache_put(unsigned int hash, const disk_item_t *it);
+void *diskcache_get(const char *url, unsigned int hash, size_t room, void *(*alloc)(size_t), disk_item_t *it);
+void diskcache_remove(const char *url, unsigned int hash);
+void diskcache_stats(diskcache_stats_t *st);
+
+#endif /* __DISKCACHE_H__ */
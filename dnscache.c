@@ -0,0 +1,281 @@
+/*
+ * dnscache.c - in-process cache of hostname lookups for upstream connects
+ *
+ *     getaddrinfo is synchronous and every request used to pay for it.
+ *     Results are kept per hostname (without the port) for a fixed TTL,
+ *     since getaddrinfo does not report the record TTL. Definite
+ *     failures are cached too, for a shorter time. While one thread is
+ *     resolving a name, other threads asking for the same name wait for
+ *     its answer instead of starting their own lookup (single-flight).
+ *     The lookup runs without the lock into a local result that is only
+ *     copied into the entry under it, and a woken waiter that finds the
+ *     entry being resolved again (it expired before the waiter ran) waits
+ *     for that lookup too.
+ */
+#include "dnscache.h"
+
+#define DNS_BUCKETS 256
+
+enum { DNS_PENDING, DNS_OK, DNS_FAIL };
+
+/* What one lookup found */
+typedef struct {
+    int rc;                     /* getaddrinfo error, or 0 */
+    int naddrs;
+    struct {
+        int family, socktype, protocol;
+        socklen_t addrlen;
+        struct sockaddr_storage addr;   /* Port left as zero */
+    } addrs[DNS_MAX_ADDRS];
+} dns_result_t;
+
+typedef struct dns_entry {
+    char *host;                 /* Lowercased hostname */
+    int state;
+    time_t expires;
+    dns_result_t r;             /* Last lookup; only read or written under mutex */
+    int waiters;                /* Threads blocked on done */
+    int refs;                   /* Waiters still holding a pointer to it */
+    sem_t done;                 /* Posted once per waiter when resolved */
+    struct dns_entry *next;
+} dns_entry_t;
+
+static dns_entry_t *buckets[DNS_BUCKETS];
+static sem_t mutex;             /* Protects buckets and the counters below */
+static int ttl = DNS_TTL, neg_ttl = DNS_NEG_TTL;
+static int nentries;
+static unsigned long hits, neg_hits, misses, joined, failures;
+
+static unsigned int hash_host(const char *host)
+{
+    unsigned int h = 5381;
+
+    while (*host)
+        h = h * 33 + (unsigned char)*host++;
+    return h;
+}
+
+/* Drop every expired entry nobody is resolving. Caller holds mutex */
+static void sweep(time_t now)
+{
+    dns_entry_t **ep, *e;
+    int i;
+
+    for (i = 0; i < DNS_BUCKETS; i++) {
+        ep = &buckets[i];
+        while ((e = *ep) != NULL) {
+            if (e->state != DNS_PENDING && e->refs == 0 && e->expires <= now) {
+                *ep = e->next;
+                Free(e->host);
+                Free(e);
+                nentries--;
+            } else {
+                ep = &e->next;
+            }
+        }
+    }
+}
+
+/*
+ * make_list - Build an addrinfo list for port from a lookup result. The
+ *     list and its addresses live in one block freed by dns_freeaddrinfo.
+ */
+static struct addrinfo *make_list(dns_result_t *r, int port)
+{
+    struct addrinfo *list;
+    struct sockaddr_storage *addrs;
+    int i;
+
+    list = Calloc(r->naddrs, sizeof(struct addrinfo) + sizeof(struct sockaddr_storage));
+    addrs = (struct sockaddr_storage *)(list + r->naddrs);
+    for (i = 0; i < r->naddrs; i++) {
+        addrs[i] = r->addrs[i].addr;
+        if (r->addrs[i].family == AF_INET6)
+            ((struct sockaddr_in6 *)&addrs[i])->sin6_port = htons(port);
+        else
+            ((struct sockaddr_in *)&addrs[i])->sin_port = htons(port);
+        list[i].ai_family = r->addrs[i].family;
+        list[i].ai_socktype = r->addrs[i].socktype;
+        list[i].ai_protocol = r->addrs[i].protocol;
+        list[i].ai_addrlen = r->addrs[i].addrlen;
+        list[i].ai_addr = (struct sockaddr *)&addrs[i];
+        list[i].ai_next = i + 1 < r->naddrs ? &list[i + 1] : NULL;
+    }
+    return list;
+}
+
+/*
+ * resolve - Look host up into r. Called without the mutex, so r must be
+ *     the caller's own; the result is published into the entry under it.
+ */
+static void resolve(dns_result_t *r, char *host)
+{
+    struct addrinfo hints, *listp, *p;
+    int rc;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    rc = getaddrinfo(host, NULL, &hints, &listp);
+
+    r->naddrs = 0;
+    if (rc == 0) {
+        for (p = listp; p && r->naddrs < DNS_MAX_ADDRS; p = p->ai_next) {
+            if (p->ai_addrlen > sizeof(struct sockaddr_storage))
+                continue;
+            r->addrs[r->naddrs].family = p->ai_family;
+            r->addrs[r->naddrs].socktype = p->ai_socktype;
+            r->addrs[r->naddrs].protocol = p->ai_protocol;
+            r->addrs[r->naddrs].addrlen = p->ai_addrlen;
+            memcpy(&r->addrs[r->naddrs].addr, p->ai_addr, p->ai_addrlen);
+            r->naddrs++;
+        }
+        freeaddrinfo(listp);
+        if (r->naddrs == 0)
+            rc = EAI_FAIL;
+    }
+    r->rc = rc;
+}
+
+/* Answer from a resolved entry. Caller holds mutex */
+static int answer(dns_entry_t *e, char *port, struct addrinfo **res)
+{
+    if (e->state != DNS_OK)
+        return e->r.rc;
+    *res = make_list(&e->r, atoi(port));
+    return 0;
+}
+
+void dnscache_init(int ttl_arg, int neg_ttl_arg)
+{
+    Sem_init(&mutex, 0, 1);
+    ttl = ttl_arg;
+    neg_ttl = neg_ttl_arg;
+}
+
+/*
+ * dns_getaddrinfo - Like getaddrinfo(host, port) for a numeric port and
+ *     SOCK_STREAM, but answered from the cache when possible. Returns 0
+ *     and a list to free with dns_freeaddrinfo, or a getaddrinfo error.
+ */
+int dns_getaddrinfo(char *host, char *port, struct addrinfo **res)
+{
+    char key[MAXLINE];
+    dns_entry_t **bp, *e;
+    dns_result_t r;
+    time_t now;
+    size_t i;
+    int rc;
+
+    for (i = 0; host[i] && i < sizeof(key) - 1; i++)
+        key[i] = tolower((unsigned char)host[i]);
+    key[i] = '\0';
+    bp = &buckets[hash_host(key) % DNS_BUCKETS];
+
+    P(&mutex);
+    now = time(NULL);
+    for (e = *bp; e; e = e->next)
+        if (!strcmp(e->host, key))
+            break;
+    if (e && e->state == DNS_PENDING) {
+        /* Someone is already resolving this name; take their answer. If
+           it expired and another lookup began before we ran, wait for
+           that one too rather than read an entry being resolved */
+        joined++;
+        do {
+            e->waiters++;
+            e->refs++;
+            V(&mutex);
+            P(&e->done);
+            P(&mutex);
+            e->refs--;
+        } while (e->state == DNS_PENDING);
+        rc = answer(e, port, res);
+        V(&mutex);
+        return rc;
+    }
+    if (e && e->expires > now) {
+        if (e->state == DNS_OK)
+            hits++;
+        else
+            neg_hits++;
+        rc = answer(e, port, res);
+        V(&mutex);
+        return rc;
+    }
+
+    /* Missing or expired: this thread does the lookup */
+    misses++;
+    if (!e) {
+        if (nentries >= DNS_MAX_ENTRIES)
+            sweep(now);
+        e = Calloc(1, sizeof(dns_entry_t));
+        e->host = Malloc(strlen(key) + 1);
+        strcpy(e->host, key);
+        Sem_init(&e->done, 0, 0);
+        e->next = *bp;
+        *bp = e;
+        nentries++;
+    }
+    e->state = DNS_PENDING;
+    V(&mutex);
+
+    resolve(&r, key);
+
+    P(&mutex);
+    now = time(NULL);
+    e->r = r;
+    if (r.rc == 0) {
+        e->state = DNS_OK;
+        e->expires = now + ttl;
+    } else {
+        failures++;
+        e->state = DNS_FAIL;
+        /* Only definite answers are worth remembering; a resolver that
+           timed out should be asked again by the next request */
+        e->expires = (r.rc == EAI_NONAME || r.rc == EAI_FAIL) ? now + neg_ttl : 0;
+    }
+    while (e->waiters > 0) {
+        e->waiters--;
+        V(&e->done);
+    }
+    rc = answer(e, port, res);
+    V(&mutex);
+    return rc;
+}
+
+void dns_freeaddrinfo(struct addrinfo *res)
+{
+    Free(res);
+}
+
+/*
+ * dns_open_clientfd - open_clientfd that resolves through the cache and
+ *     gives up after timeout_ms (0 for no deadline). Returns -2 for a
+ *     lookup error, -1 with errno set for other errors.
+ */
+int dns_open_clientfd(char *host, char *port, int timeout_ms)
+{
+    int clientfd, rc;
+    struct addrinfo *listp;
+
+    if ((rc = dns_getaddrinfo(host, port, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", host, port, gai_strerror(rc));
+        return -2;
+    }
+    clientfd = connect_addrs(listp, timeout_ms);
+    dns_freeaddrinfo(listp);
+    return clientfd;
+}
+
+void dnscache_stats(dnscache_stats_t *st)
+{
+    P(&mutex);
+    st->entries = nentries;
+    st->hits = hits;
+    st->neg_hits = neg_hits;
+    st->misses = misses;
+    st->joined = joined;
+    st->failures = failures;
+    V(&mutex);
+}
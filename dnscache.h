@@ -0,0 +1,30 @@
+/*
+ * dnscache.h - in-process cache of hostname lookups for upstream connects
+ */
+#ifndef __DNSCACHE_H__
+#define __DNSCACHE_H__
+
+#include "csapp.h"
+
+#define DNS_TTL 60            /* Seconds a successful lookup is reused */
+#define DNS_NEG_TTL 5         /* Seconds a failed lookup is remembered */
+#define DNS_MAX_ENTRIES 1024  /* Hostnames kept at most */
+#define DNS_MAX_ADDRS 8       /* Addresses kept per hostname */
+
+/* Snapshot of the cache counters returned by dnscache_stats */
+typedef struct {
+    int entries;              /* Hostnames currently cached */
+    unsigned long hits;       /* Answered from a fresh entry */
+    unsigned long neg_hits;   /* Answered from a cached failure */
+    unsigned long misses;     /* Had to call getaddrinfo */
+    unsigned long joined;     /* Waited on a lookup another thread started */
+    unsigned long failures;   /* getaddrinfo calls that failed */
+} dnscache_stats_t;
+
+void dnscache_init(int ttl, int neg_ttl);
+int dns_getaddrinfo(char *host, char *port, struct addrinfo **res);
+void dns_freeaddrinfo(struct addrinfo *res);
+int dns_open_clientfd(char *host, char *port, int timeout_ms);
+void dnscache_stats(dnscache_stats_t *st);
+
+#endif /* __DNSCACHE_H__ */
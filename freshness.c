@@ -0,0 +1,241 @@
+/*
+ * freshness.c - HTTP freshness rules for the shared web object cache
+ *
+ *     Reads a response's headers (status line through the blank line)
+ *     the way a shared cache must (RFC 9111): no-store and private
+ *     responses are not stored, nor are ones that set a cookie or vary
+ *     on request headers the cache does not key on (the cache and
+ *     collapsed forwarding would hand them to other clients); the
+ *     lifetime is s-maxage, else
+ *     max-age, else Expires minus Date, less the response's age
+ *     (Age, or how far Date is behind our clock). Responses without
+ *     any of those get a heuristic lifetime if their status allows it:
+ *     10% of the time since Last-Modified, or the default TTL. no-cache
+ *     responses are stored already stale, so every use revalidates.
+ */
+#include "freshness.h"
+
+/* Statuses a cache may store without explicit freshness (RFC 9110 15.1) */
+static int heuristic_status(int status)
+{
+    switch (status) {
+    case 200: case 203: case 204: case 300: case 301: case 308:
+    case 404: case 405: case 410: case 414: case 501:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Value of the first name header in hdrs[0..len), trimmed, or NULL. Skips the status line */
+const char *http_header_value(const char *hdrs, size_t len, const char *name, size_t *vlen)
+{
+    size_t namelen = strlen(name);
+    const char *line = hdrs, *end = hdrs + len, *eol, *v, *e;
+
+    if ((eol = memchr(line, '\n', end - line)) == NULL)
+        return NULL;
+    for (line = eol + 1; line < end && (eol = memchr(line, '\n', end - line)) != NULL; line = eol + 1) {
+        if ((size_t)(eol - line) <= namelen || strncasecmp(line, name, namelen) || line[namelen] != ':')
+            continue;
+        for (v = line + namelen + 1; v < eol && (*v == ' ' || *v == '\t'); v++)
+            ;
+        for (e = eol; e > v && (e[-1] == '\r' || e[-1] == ' ' || e[-1] == '\t'); e--)
+            ;
+        *vlen = e - v;
+        return v;
+    }
+    return NULL;
+}
+
+static int month_of(const char *m)
+{
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    const char *p;
+
+    for (p = months; *p; p += 3)
+        if (!strncmp(p, m, 3))
+            return (p - months) / 3;
+    return -1;
+}
+
+/* HTTP-date in any of its three formats (RFC 9110 5.6.7), or -1 */
+time_t http_date(const char *s, size_t len)
+{
+    char buf[64], mon[4];
+    struct tm tm;
+
+    if (len >= sizeof(buf))
+        return -1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(buf, "%*[a-zA-Z], %d %3s %d %d:%d:%d GMT",
+               &tm.tm_mday, mon, &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6
+        || sscanf(buf, "%*[a-zA-Z], %d-%3s-%d %d:%d:%d GMT",
+                  &tm.tm_mday, mon, &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) == 6
+        || sscanf(buf, "%*[a-zA-Z] %3s %d %d:%d:%d %d",
+                  mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &tm.tm_year) == 6) {
+        mon[3] = '\0';
+        if ((tm.tm_mon = month_of(mon)) < 0)
+            return -1;
+        if (tm.tm_year < 70)            /* Two-digit years of the RFC 850 form */
+            tm.tm_year += 2000;
+        else if (tm.tm_year < 100)
+            tm.tm_year += 1900;
+        tm.tm_year -= 1900;
+        return timegm(&tm);
+    }
+    return -1;
+}
+
+static time_t header_date(const char *hdrs, size_t len, const char *name)
+{
+    const char *v;
+    size_t vlen;
+
+    if ((v = http_header_value(hdrs, len, name, &vlen)) == NULL)
+        return -1;
+    return http_date(v, vlen);
+}
+
+/* Vary that every client can share: only Accept-Encoding, on a body that is not encoded */
+static int shared_vary(const char *hdrs, size_t len)
+{
+    const char *v, *e, *end;
+    size_t vlen, n;
+
+    if ((v = http_header_value(hdrs, len, "Vary", &vlen)) == NULL)
+        return 1;
+    if (http_header_value(hdrs, len, "Content-Encoding", &n) != NULL)
+        return 0;
+    for (end = v + vlen; v < end; v = e + 1) {
+        while (v < end && (*v == ' ' || *v == '\t' || *v == ','))
+            v++;
+        if (v == end)
+            break;
+        if ((e = memchr(v, ',', end - v)) == NULL)
+            e = end;
+        for (n = e - v; n > 0 && (v[n - 1] == ' ' || v[n - 1] == '\t'); n--)
+            ;
+        if (n != 15 || strncasecmp(v, "Accept-Encoding", 15))
+            return 0;
+    }
+    return 1;
+}
+
+/* Status code of the status line in hdrs[0..len), or 0. Never reads past len */
+static int status_of(const char *hdrs, size_t len)
+{
+    const char *sp, *eol;
+    char buf[8];
+    size_t n;
+
+    if ((eol = memchr(hdrs, '\n', len)) == NULL)
+        eol = hdrs + len;
+    if (len < 5 || strncmp(hdrs, "HTTP/", 5) || (sp = memchr(hdrs, ' ', eol - hdrs)) == NULL)
+        return 0;
+    n = eol - sp - 1 < sizeof(buf) - 1 ? eol - sp - 1 : sizeof(buf) - 1;
+    memcpy(buf, sp + 1, n);
+    buf[n] = '\0';
+    return isdigit((unsigned char)buf[0]) ? (int)strtol(buf, NULL, 10) : 0;
+}
+
+/* Delta-seconds value after "name=" in a directive, or -1 */
+static long directive_secs(const char *d, size_t dlen, size_t namelen)
+{
+    char buf[24];
+    size_t n;
+
+    if (dlen <= namelen + 1 || d[namelen] != '=')
+        return -1;
+    d += namelen + 1;
+    dlen -= namelen + 1;
+    if (*d == '"') {
+        d++;
+        dlen--;
+    }
+    n = dlen < sizeof(buf) - 1 ? dlen : sizeof(buf) - 1;
+    memcpy(buf, d, n);
+    buf[n] = '\0';
+    return isdigit((unsigned char)buf[0]) ? atol(buf) : -1;
+}
+
+#define DIRECTIVE(name) (dlen >= sizeof(name) - 1 && !strncasecmp(d, name, sizeof(name) - 1) \
+                         && (dlen == sizeof(name) - 1 || d[sizeof(name) - 1] == '='))
+
+/* Fill f from the response headers hdrs[0..len), received at now */
+void freshness_parse(const char *hdrs, size_t len, time_t now, time_t default_ttl, freshness_t *f)
+{
+    const char *line, *end = hdrs + len, *eol, *d, *e;
+    long max_age = -1, s_maxage = -1, v, age = 0, lifetime;
+    int status, no_cache = 0;
+    time_t date, expires, lm;
+    size_t dlen, vlen;
+
+    f->store = 1;
+    f->explicit_ttl = 0;
+    f->validator = http_header_value(hdrs, len, "ETag", &vlen) != NULL
+        || http_header_value(hdrs, len, "Last-Modified", &vlen) != NULL;
+    status = status_of(hdrs, len);
+    if (http_header_value(hdrs, len, "Set-Cookie", &vlen) != NULL || !shared_vary(hdrs, len))
+        f->store = 0;
+
+    /* Cache-Control may be split over several lines; directives are comma separated */
+    if ((eol = memchr(hdrs, '\n', len)) == NULL)
+        eol = end;
+    for (line = eol + 1; line < end && (eol = memchr(line, '\n', end - line)) != NULL; line = eol + 1) {
+        if (eol - line < 14 || strncasecmp(line, "Cache-Control:", 14))
+            continue;
+        for (d = line + 14; d < eol; d = e + 1) {
+            while (d < eol && (*d == ' ' || *d == '\t' || *d == ','))
+                d++;
+            if ((e = memchr(d, ',', eol - d)) == NULL)
+                e = eol;
+            for (dlen = e - d; dlen > 0 && (d[dlen - 1] == '\r' || d[dlen - 1] == ' '); dlen--)
+                ;
+            if (DIRECTIVE("no-store") || DIRECTIVE("private"))
+                f->store = 0;
+            else if (DIRECTIVE("no-cache"))
+                no_cache = 1;
+            else if (DIRECTIVE("s-maxage") && (v = directive_secs(d, dlen, 8)) >= 0)
+                s_maxage = v;
+            else if (DIRECTIVE("max-age") && (v = directive_secs(d, dlen, 7)) >= 0)
+                max_age = v;
+        }
+    }
+
+    if ((date = header_date(hdrs, len, "Date")) < 0)
+        date = now;
+    if ((d = http_header_value(hdrs, len, "Age", &vlen)) != NULL && isdigit((unsigned char)*d))
+        age = atol(d);
+    if (now - date > age)
+        age = now - date;
+
+    if (s_maxage >= 0 || max_age >= 0) {
+        lifetime = s_maxage >= 0 ? s_maxage : max_age;
+        f->explicit_ttl = 1;
+    }
+    else if (http_header_value(hdrs, len, "Expires", &vlen) != NULL) {
+        /* An Expires that does not parse, like "0", means already expired */
+        lifetime = (expires = header_date(hdrs, len, "Expires")) < 0 ? 0 : expires - date;
+        f->explicit_ttl = 1;
+    }
+    else if ((lm = header_date(hdrs, len, "Last-Modified")) >= 0 && lm < date) {
+        lifetime = (date - lm) / 10;
+        if (lifetime > FRESH_HEURISTIC_MAX)
+            lifetime = FRESH_HEURISTIC_MAX;
+    }
+    else {
+        lifetime = default_ttl;
+    }
+
+    if (status < 200 || status == 206 || status == 304 || (!f->explicit_ttl && !heuristic_status(status)))
+        f->store = 0;
+    f->expires = now + (lifetime > age ? lifetime - age : 0);
+    if (no_cache)
+        f->expires = now;
+    /* Stale on arrival and nothing to revalidate with: storing it is useless */
+    if (f->expires <= now && !f->validator)
+        f->store = 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * freshness.h - HTTP freshness rules for the shared web object cache
+ */
+#ifndef __FRESHNESS_H__
+#define __FRESHNESS_H__
+
+#include "csapp.h"
+
+#define FRESH_DEFAULT_TTL 300       /* Seconds of freshness for responses that say nothing */
+#define FRESH_HEURISTIC_MAX 86400   /* Cap on the 10%-of-Last-Modified-age heuristic */
+
+/* What a response's headers allow a shared cache to do with it */
+typedef struct {
+    int store;              /* May be stored, and so shared with other clients */
+    int explicit_ttl;       /* Lifetime came from Cache-Control or Expires */
+    int validator;          /* Has an ETag or Last-Modified to revalidate with */
+    time_t expires;         /* Fresh until then (wall clock) */
+} freshness_t;
+
+void freshness_parse(const char *hdrs, size_t len, time_t now, time_t default_ttl, freshness_t *f);
+const char *http_header_value(const char *hdrs, size_t len, const char *name, size_t *vlen);
+time_t http_date(const char *s, size_t len);
+
+#endif /* __FRESHNESS_H__ */
@@ -0,0 +1,593 @@
+/*
+ * policy.c - pluggable eviction policies for the web object cache
+ *
+ *     lru       Least recently used: one list, hits move to the front.
+ *     clock     FIFO with a reference bit (second chance): a hit only
+ *               sets the bit, and the victim search gives referenced
+ *               objects one more lap.
+ *     s3fifo    A small FIFO (10% of the bytes) filters one-hit wonders
+ *               out before they reach the main FIFO; a ghost table of
+ *               recently evicted keys sends returning objects straight
+ *               to main. Main reinserts objects while their hit count
+ *               lasts.
+ *     wtinylfu  A 1% LRU window in front of a segmented LRU main area
+ *               (20% probation, 80% protected). An object leaving a
+ *               full window must beat the main victim's estimated
+ *               access frequency, kept in a count-min sketch of hits
+ *               and misses that is halved periodically.
+ *     gdsf      GreedyDual-Size-Frequency: evicts the lowest
+ *               L + hits * fetch time / size, where L rises to each
+ *               victim's value so that idle objects age out. Objects
+ *               that were slow to fetch and small keep their place;
+ *               the goal is origin time saved per cached byte.
+ *
+ *     The queue policies keep doubly linked lists threaded through
+ *     per-slot arrays, so every operation is O(1) (amortized for the
+ *     reinsertion loops). gdsf keeps a binary min-heap, O(log n).
+ */
+#include "policy.h"
+
+/* Queues threaded through shared per-slot link arrays */
+typedef struct {
+    int head, tail;             /* Most recent, oldest; -1 if empty */
+    int n;
+    size_t bytes;
+} queue_t;
+
+typedef struct {
+    int *prev, *next;
+    size_t *size;
+    unsigned int *hash;
+    unsigned char *where;       /* Queue the slot is on, Q_NONE if none */
+    unsigned char *freq;        /* Per-policy hit counter or reference bit */
+} slots_t;
+
+enum { Q_NONE, Q_MAIN, Q_SMALL, Q_WINDOW, Q_PROBATION, Q_PROTECTED };
+
+static void slots_init(slots_t *s, int nslots)
+{
+    s->prev = Malloc(nslots * sizeof(int));
+    s->next = Malloc(nslots * sizeof(int));
+    s->size = Calloc(nslots, sizeof(size_t));
+    s->hash = Calloc(nslots, sizeof(unsigned int));
+    s->where = Calloc(nslots, 1);
+    s->freq = Calloc(nslots, 1);
+}
+
+static void queue_init(queue_t *q)
+{
+    q->head = q->tail = -1;
+    q->n = 0;
+    q->bytes = 0;
+}
+
+static void q_push(slots_t *s, queue_t *q, int id, int i)
+{
+    s->prev[i] = -1;
+    s->next[i] = q->head;
+    if (q->head != -1)
+        s->prev[q->head] = i;
+    q->head = i;
+    if (q->tail == -1)
+        q->tail = i;
+    q->n++;
+    q->bytes += s->size[i];
+    s->where[i] = id;
+}
+
+static void q_unlink(slots_t *s, queue_t *q, int i)
+{
+    if (s->prev[i] != -1)
+        s->next[s->prev[i]] = s->next[i];
+    else
+        q->head = s->next[i];
+    if (s->next[i] != -1)
+        s->prev[s->next[i]] = s->prev[i];
+    else
+        q->tail = s->prev[i];
+    q->n--;
+    q->bytes -= s->size[i];
+    s->where[i] = Q_NONE;
+}
+
+/* Move i from wherever it is to the front of q */
+static void q_move(slots_t *s, queue_t *from, queue_t *to, int id, int i)
+{
+    q_unlink(s, from, i);
+    q_push(s, to, id, i);
+}
+
+/*
+ * LRU
+ */
+typedef struct {
+    slots_t s;
+    queue_t q;
+} lru_t;
+
+static void *lru_create(int nslots, size_t max_bytes)
+{
+    lru_t *p = Malloc(sizeof(lru_t));
+
+    slots_init(&p->s, nslots);
+    queue_init(&p->q);
+    return p;
+}
+
+static void lru_hit(void *v, int i)
+{
+    lru_t *p = v;
+
+    if (p->q.head != i)
+        q_move(&p->s, &p->q, &p->q, Q_MAIN, i);
+}
+
+static void lru_insert(void *v, int i, unsigned int hash, size_t size, unsigned long cost_us)
+{
+    lru_t *p = v;
+
+    p->s.size[i] = size;
+    q_push(&p->s, &p->q, Q_MAIN, i);
+}
+
+static void lru_remove(void *v, int i)
+{
+    lru_t *p = v;
+
+    q_unlink(&p->s, &p->q, i);
+}
+
+static int lru_victim(void *v)
+{
+    lru_t *p = v;
+    int i = p->q.tail;
+
+    if (i != -1)
+        q_unlink(&p->s, &p->q, i);
+    return i;
+}
+
+const cache_policy policy_lru = {
+    "lru", lru_create, lru_hit, NULL, lru_insert, lru_remove, lru_victim
+};
+
+/*
+ * CLOCK, as a FIFO whose tail is the hand: a referenced object at the
+ * tail has its bit cleared and goes back to the head.
+ */
+static void clock_hit(void *v, int i)
+{
+    ((lru_t *)v)->s.freq[i] = 1;
+}
+
+static void clock_insert(void *v, int i, unsigned int hash, size_t size, unsigned long cost_us)
+{
+    lru_t *p = v;
+
+    p->s.size[i] = size;
+    p->s.freq[i] = 0;
+    q_push(&p->s, &p->q, Q_MAIN, i);
+}
+
+static int clock_victim(void *v)
+{
+    lru_t *p = v;
+    int i;
+
+    while ((i = p->q.tail) != -1 && p->s.freq[i]) {
+        p->s.freq[i] = 0;
+        q_move(&p->s, &p->q, &p->q, Q_MAIN, i);
+    }
+    if (i != -1)
+        q_unlink(&p->s, &p->q, i);
+    return i;
+}
+
+const cache_policy policy_clock = {
+    "clock", lru_create, clock_hit, NULL, clock_insert, lru_remove, clock_victim
+};
+
+/*
+ * S3-FIFO
+ */
+#define S3_SMALL_PCT 10
+#define S3_MAX_FREQ 3
+
+typedef struct {
+    slots_t s;
+    queue_t small, main;
+    size_t small_target;
+    unsigned int *ghost;        /* Hashes evicted from small, direct mapped */
+    unsigned long *ghost_seq;   /* When each was added */
+    unsigned long seq;          /* Ghost insertions so far */
+    unsigned int ghost_mask;
+} s3fifo_t;
+
+static void *s3fifo_create(int nslots, size_t max_bytes)
+{
+    s3fifo_t *p = Malloc(sizeof(s3fifo_t));
+    unsigned int n;
+
+    slots_init(&p->s, nslots);
+    queue_init(&p->small);
+    queue_init(&p->main);
+    p->small_target = max_bytes / 100 * S3_SMALL_PCT;
+    for (n = 16; n < 2 * (unsigned int)nslots; n <<= 1)
+        ;
+    p->ghost = Calloc(n, sizeof(unsigned int));
+    p->ghost_seq = Calloc(n, sizeof(unsigned long));
+    p->ghost_mask = n - 1;
+    p->seq = 0;
+    return p;
+}
+
+/* The ghost remembers about as many keys as the cache holds objects */
+static int ghost_take(s3fifo_t *p, unsigned int hash)
+{
+    unsigned int g = hash & p->ghost_mask;
+
+    if (p->ghost_seq[g] == 0 || p->ghost[g] != hash
+        || p->seq - p->ghost_seq[g] >= (unsigned long)(p->small.n + p->main.n + 1))
+        return 0;
+    p->ghost_seq[g] = 0;
+    return 1;
+}
+
+static void ghost_put(s3fifo_t *p, unsigned int hash)
+{
+    unsigned int g = hash & p->ghost_mask;
+
+    p->ghost[g] = hash;
+    p->ghost_seq[g] = ++p->seq;
+}
+
+static void s3fifo_hit(void *v, int i)
+{
+    s3fifo_t *p = v;
+
+    if (p->s.freq[i] < S3_MAX_FREQ)
+        p->s.freq[i]++;
+}
+
+static void s3fifo_insert(void *v, int i, unsigned int hash, size_t size, unsigned long cost_us)
+{
+    s3fifo_t *p = v;
+
+    p->s.size[i] = size;
+    p->s.hash[i] = hash;
+    p->s.freq[i] = 0;
+    if (ghost_take(p, hash))
+        q_push(&p->s, &p->main, Q_MAIN, i);
+    else
+        q_push(&p->s, &p->small, Q_SMALL, i);
+}
+
+static void s3fifo_remove(void *v, int i)
+{
+    s3fifo_t *p = v;
+
+    q_unlink(&p->s, p->s.where[i] == Q_SMALL ? &p->small : &p->main, i);
+}
+
+static int s3fifo_victim(void *v)
+{
+    s3fifo_t *p = v;
+    int i;
+
+    for (;;) {
+        if (p->small.n > 0 && (p->small.bytes >= p->small_target || p->main.n == 0)) {
+            i = p->small.tail;
+            if (p->s.freq[i] > 0) {         /* Hit while in small: keep it */
+                p->s.freq[i] = 0;
+                q_move(&p->s, &p->small, &p->main, Q_MAIN, i);
+                continue;
+            }
+            q_unlink(&p->s, &p->small, i);
+            ghost_put(p, p->s.hash[i]);
+            return i;
+        }
+        if ((i = p->main.tail) == -1)
+            return -1;
+        if (p->s.freq[i] > 0) {
+            p->s.freq[i]--;
+            q_move(&p->s, &p->main, &p->main, Q_MAIN, i);
+            continue;
+        }
+        q_unlink(&p->s, &p->main, i);
+        return i;
+    }
+}
+
+const cache_policy policy_s3fifo = {
+    "s3fifo", s3fifo_create, s3fifo_hit, NULL, s3fifo_insert, s3fifo_remove, s3fifo_victim
+};
+
+/*
+ * W-TinyLFU
+ */
+#define WTL_WINDOW_PCT 1
+#define WTL_PROTECTED_PCT 80        /* Of the main area */
+#define WTL_ROWS 4
+
+typedef struct {
+    slots_t s;
+    queue_t window, probation, protected;
+    size_t window_target, main_target, protected_target;
+    unsigned char *sketch;      /* WTL_ROWS rows of width counters */
+    unsigned int width_mask;
+    unsigned long additions, reset_at;
+} wtinylfu_t;
+
+static void *wtinylfu_create(int nslots, size_t max_bytes)
+{
+    wtinylfu_t *p = Malloc(sizeof(wtinylfu_t));
+    unsigned int w;
+
+    slots_init(&p->s, nslots);
+    queue_init(&p->window);
+    queue_init(&p->probation);
+    queue_init(&p->protected);
+    p->window_target = max_bytes / 100 * WTL_WINDOW_PCT;
+    p->main_target = max_bytes - p->window_target;
+    p->protected_target = p->main_target / 100 * WTL_PROTECTED_PCT;
+    for (w = 64; w < 4 * (unsigned int)nslots; w <<= 1)
+        ;
+    p->sketch = Calloc(WTL_ROWS * w, 1);
+    p->width_mask = w - 1;
+    p->additions = 0;
+    p->reset_at = 10UL * w;
+    return p;
+}
+
+/* Counter of hash in row r; each row mixes the hash with a different odd constant */
+static unsigned char *sketch_at(wtinylfu_t *p, unsigned int hash, int r)
+{
+    static const unsigned int seeds[WTL_ROWS] = {
+        0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu
+    };
+    unsigned int h = (hash ^ (hash >> 15)) * seeds[r];
+
+    return &p->sketch[r * (p->width_mask + 1) + ((h >> 16) & p->width_mask)];
+}
+
+static unsigned int sketch_estimate(wtinylfu_t *p, unsigned int hash)
+{
+    unsigned int m = 255, c;
+    int r;
+
+    for (r = 0; r < WTL_ROWS; r++)
+        if ((c = *sketch_at(p, hash, r)) < m)
+            m = c;
+    return m;
+}
+
+/* Counts one access. After reset_at of them every counter is halved so old popularity fades */
+static void sketch_add(wtinylfu_t *p, unsigned int hash)
+{
+    unsigned char *c;
+    unsigned int j;
+    int r;
+
+    for (r = 0; r < WTL_ROWS; r++)
+        if (*(c = sketch_at(p, hash, r)) < 15)
+            (*c)++;
+    if (++p->additions >= p->reset_at) {
+        for (j = 0; j < WTL_ROWS * (p->width_mask + 1); j++)
+            p->sketch[j] >>= 1;
+        p->additions /= 2;
+    }
+}
+
+static queue_t *wtl_queue(wtinylfu_t *p, int i)
+{
+    switch (p->s.where[i]) {
+    case Q_WINDOW: return &p->window;
+    case Q_PROBATION: return &p->probation;
+    default: return &p->protected;
+    }
+}
+
+static void wtinylfu_hit(void *v, int i)
+{
+    wtinylfu_t *p = v;
+    int d;
+
+    sketch_add(p, p->s.hash[i]);
+    if (p->s.where[i] == Q_PROBATION) {
+        q_move(&p->s, &p->probation, &p->protected, Q_PROTECTED, i);
+        while (p->protected.bytes > p->protected_target && (d = p->protected.tail) != i)
+            q_move(&p->s, &p->protected, &p->probation, Q_PROBATION, d);
+    }
+    else {
+        queue_t *q = wtl_queue(p, i);
+        q_move(&p->s, q, q, p->s.where[i], i);
+    }
+}
+
+static void wtinylfu_miss(void *v, unsigned int hash)
+{
+    sketch_add(v, hash);
+}
+
+/* New objects enter the window. Its overflow moves to probation while the main area has room;
+   once main is full it stays in the window and has to win a duel in wtinylfu_victim */
+static void wtinylfu_insert(void *v, int i, unsigned int hash, size_t size, unsigned long cost_us)
+{
+    wtinylfu_t *p = v;
+    int c;
+
+    p->s.size[i] = size;
+    p->s.hash[i] = hash;
+    q_push(&p->s, &p->window, Q_WINDOW, i);
+    while (p->window.bytes > p->window_target && (c = p->window.tail) != i
+           && p->probation.bytes + p->protected.bytes + p->s.size[c] <= p->main_target)
+        q_move(&p->s, &p->window, &p->probation, Q_PROBATION, c);
+}
+
+static void wtinylfu_remove(void *v, int i)
+{
+    wtinylfu_t *p = v;
+
+    q_unlink(&p->s, wtl_queue(p, i), i);
+}
+
+static int wtinylfu_victim(void *v)
+{
+    wtinylfu_t *p = v;
+    queue_t *mq = p->probation.n > 0 ? &p->probation : &p->protected;
+    int c = p->window.tail, m = mq->tail;
+
+    if (c != -1 && (p->window.bytes > p->window_target || m == -1)) {
+        /* The window's oldest either displaces main's victim or is dropped itself */
+        if (m != -1 && sketch_estimate(p, p->s.hash[c]) > sketch_estimate(p, p->s.hash[m])) {
+            q_unlink(&p->s, mq, m);
+            q_move(&p->s, &p->window, &p->probation, Q_PROBATION, c);
+            return m;
+        }
+        q_unlink(&p->s, &p->window, c);
+        return c;
+    }
+    if (m != -1)
+        q_unlink(&p->s, mq, m);
+    return m;
+}
+
+const cache_policy policy_wtinylfu = {
+    "wtinylfu", wtinylfu_create, wtinylfu_hit, wtinylfu_miss, wtinylfu_insert,
+    wtinylfu_remove, wtinylfu_victim
+};
+
+/*
+ * GDSF
+ */
+typedef struct {
+    int *heap;                  /* Slots, smallest priority first */
+    int *pos;                   /* Index of each slot in heap */
+    int n;
+    double *prio;
+    double *value;              /* Fetch time per byte */
+    unsigned int *hits;
+    double inflation;           /* L: priority of the last victim */
+} gdsf_t;
+
+static void *gdsf_create(int nslots, size_t max_bytes)
+{
+    gdsf_t *p = Malloc(sizeof(gdsf_t));
+
+    p->heap = Malloc(nslots * sizeof(int));
+    p->pos = Malloc(nslots * sizeof(int));
+    p->prio = Calloc(nslots, sizeof(double));
+    p->value = Calloc(nslots, sizeof(double));
+    p->hits = Calloc(nslots, sizeof(unsigned int));
+    p->n = 0;
+    p->inflation = 0;
+    return p;
+}
+
+static void heap_set(gdsf_t *p, int k, int i)
+{
+    p->heap[k] = i;
+    p->pos[i] = k;
+}
+
+static void heap_up(gdsf_t *p, int k)
+{
+    int i = p->heap[k];
+
+    while (k > 0 && p->prio[p->heap[(k - 1) / 2]] > p->prio[i]) {
+        heap_set(p, k, p->heap[(k - 1) / 2]);
+        k = (k - 1) / 2;
+    }
+    heap_set(p, k, i);
+}
+
+static void heap_down(gdsf_t *p, int k)
+{
+    int i = p->heap[k], c;
+
+    while ((c = 2 * k + 1) < p->n) {
+        if (c + 1 < p->n && p->prio[p->heap[c + 1]] < p->prio[p->heap[c]])
+            c++;
+        if (p->prio[p->heap[c]] >= p->prio[i])
+            break;
+        heap_set(p, k, p->heap[c]);
+        k = c;
+    }
+    heap_set(p, k, i);
+}
+
+/* The last slot fills the hole, then moves whichever way its priority says */
+static void heap_delete(gdsf_t *p, int i)
+{
+    int k = p->pos[i], last = p->heap[--p->n];
+
+    if (last != i) {
+        heap_set(p, k, last);
+        heap_down(p, k);
+        heap_up(p, p->pos[last]);
+    }
+}
+
+static void gdsf_hit(void *v, int i)
+{
+    gdsf_t *p = v;
+
+    p->hits[i]++;
+    p->prio[i] = p->inflation + p->hits[i] * p->value[i];
+    heap_down(p, p->pos[i]);
+}
+
+/* A fetch that took no measurable time still costs something */
+static void gdsf_insert(void *v, int i, unsigned int hash, size_t size, unsigned long cost_us)
+{
+    gdsf_t *p = v;
+
+    p->value[i] = (double)(cost_us + 1) / (size ? size : 1);
+    p->hits[i] = 1;
+    p->prio[i] = p->inflation + p->value[i];
+    heap_set(p, p->n++, i);
+    heap_up(p, p->n - 1);
+}
+
+static void gdsf_remove(void *v, int i)
+{
+    heap_delete(v, i);
+}
+
+static int gdsf_victim(void *v)
+{
+    gdsf_t *p = v;
+    int i;
+
+    if (p->n == 0)
+        return -1;
+    i = p->heap[0];
+    p->inflation = p->prio[i];
+    heap_delete(p, i);
+    return i;
+}
+
+const cache_policy policy_gdsf = {
+    "gdsf", gdsf_create, gdsf_hit, NULL, gdsf_insert, gdsf_remove, gdsf_victim
+};
+
+static const cache_policy *policies[] = {
+    &policy_lru, &policy_clock, &policy_s3fifo, &policy_wtinylfu, &policy_gdsf
+};
+
+/* NULL if no policy is called name */
+const cache_policy *policy_find(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++)
+        if (!strcmp(name, policies[i]->name))
+            return policies[i];
+    return NULL;
+}
+
+/* For usage messages */
+const char *policy_names(void)
+{
+    return "lru|clock|s3fifo|wtinylfu|gdsf";
+}
@@ -0,0 +1,30 @@
+/*
+ * policy.h - pluggable eviction policies for the web object cache
+ */
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include "csapp.h"
+
+/*
+ * An eviction policy tracks the objects of one cache shard by slot
+ * (0..nslots-1) and decides which to evict. insert gets the object's
+ * size and how long the proxy took to fetch it from the origin. The cache serializes every
+ * call on a given state with the shard's index mutex.
+ */
+typedef struct {
+    const char *name;
+    void *(*create)(int nslots, size_t max_bytes);
+    void (*hit)(void *p, int slot);
+    void (*miss)(void *p, unsigned int hash);   /* May be NULL */
+    void (*insert)(void *p, int slot, unsigned int hash, size_t size, unsigned long cost_us);
+    void (*remove)(void *p, int slot);          /* Left the cache for another reason */
+    int (*victim)(void *p);                     /* Picks and forgets a slot; -1 if empty */
+} cache_policy;
+
+extern const cache_policy policy_lru, policy_clock, policy_s3fifo, policy_wtinylfu, policy_gdsf;
+
+const cache_policy *policy_find(const char *name);
+const char *policy_names(void);
+
+#endif /* __POLICY_H__ */
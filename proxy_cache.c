@@ -1,80 +1,145 @@
 #include <stdio.h>
+#include <sys/uio.h>
 #include "csapp.h"
+#include "cache.h"
+#include "sbuf.h"
+#include "relay.h"
+#include "connpool.h"
+#include "dnscache.h"
+#include "collapse.h"
+#include "cachekey.h"
 
 // Proxy part.3 - Cache
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-#define LRU_MAGIC_NUMBER 9999
-// Least Recently Used
-// LRU: 가장 오랫동안 참조되지 않은 페이지를 교체하는 기법
 
-#define CACHE_OBJS_COUNT 10
+#define NTHREADS 16  /* 미리 만들어두는 worker 쓰레드 수 (-t) */
+#define SBUFSIZE 64  /* accept한 connfd를 담아두는 큐 크기 (-q) */
+#define BODY_BLOCK (64 * 1024) /* response body를 한 번에 읽고 쓰는 크기 */
+#define KEEPALIVE_TIMEOUT 5    /* client connection을 놀려두는 최대 초 (-k, 0이면 keep-alive 안 함) */
+#define CONNECT_TIMEOUT 3000   /* end server connect를 포기하는 ms (-c, 0이면 기한 없음) */
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
     "Firefox/10.0.3\r\n";
 static const char *requestline_hdr_format = "GET %s HTTP/1.0\r\n";
+static const char *requestline_keep_format = "GET %s HTTP/1.1\r\n"; /* end server와 connection을 유지할 때 */
 static const char *endof_hdr = "\r\n";
 static const char *host_hdr_format = "Host: %s\r\n";
 static const char *conn_hdr = "Connection: close\r\n";
 static const char *prox_hdr = "Proxy-Connection: close\r\n";
+static const char *conn_keep_hdr = "Connection: keep-alive\r\n";
 
 static const char *host_key = "Host";
 static const char *connection_key = "Connection";
 static const char *proxy_connection_key = "Proxy-Connection";
 static const char *user_agent_key = "User-Agent";
 
-void *thread(void *vargsp);
-void doit(int connfd);
-void parse_uri(char *uri, char *hostname, char *path, int *port);
-void build_http_header(char *http_header, char *hostname, char *path, int port, rio_t *client_rio);
-int connect_endServer(char *hostname, int port, char *http_header);
-
-// cache function
-void cache_init();
-int cache_find(char *url);
-void cache_uri(char *uri, char *buf);
-
-void readerPre(int i);
-void readerAfter(int i);
-
-typedef struct 
-{
-  char cache_obj[MAX_OBJECT_SIZE];
-  char cache_url[MAXLINE];
-  int LRU; // least recently used 가장 최근에 사용한 것의 우선순위를 뒤로 미움 (캐시에서 삭제할 때)
-  int isEmpty; // 이 블럭에 캐시 정보가 들었는지 empty인지 아닌지 체크
-
-  int readCnt;  // count of readers
-  sem_t wmutex;  // protects accesses to cache 세마포어 타입. 1: 사용가능, 0: 사용 불가능
-  sem_t rdcntmutex;  // protects accesses to readcnt
-}cache_block; // 캐쉬블럭 구조체로 선언
+/* client로 나갈 bytes를 block에 모아뒀다가 한 번에 쓴다. cache에 넣을 사본도 같이 만든다 */
+typedef struct {
+  int fd;                  /* client connfd */
+  char block[BODY_BLOCK];
+  size_t fill;             /* block에 모인 bytes */
+  char *cachebuf;          /* NULL이면 cache에 안 넣는 응답 */
+  size_t cachelen;         /* cache 사본에 모인 bytes */
+  flight_t *flight;        /* NULL이 아니면 따라붙은 요청들이 읽도록 여기에도 붙인다 */
+  int error;               /* client에 쓰다가 실패 */
+  unsigned long write_us;  /* client에 쓰느라 걸린 시간. 가져온 비용에서 뺀다 */
+} out_t;
 
+/* end server 응답 header에서 읽어낸 정보 */
+typedef struct {
+  int status;
+  long content_length;     /* 없으면 -1 */
+  int chunked;             /* Transfer-Encoding: chunked */
+  int server_close;        /* 이 응답 뒤에 end server가 connection을 닫는다 */
+  size_t hdrlen;           /* hop-by-hop header를 뺀 header 길이 */
+} resp_info_t;
 
-typedef struct
-{
-  cache_block cacheobjs[CACHE_OBJS_COUNT];  // ten cache blocks
-  // int cache_num; // 캐시(10개) 넘버 부여
-  /* feedback : cache_num 사용 되는 곳 없음. 삭제해도 무방 */
-}Cache;
+#define BODY_TO_EOF (-1L)  /* end server가 닫을 때까지가 body */
+#define BODY_CHUNKED (-2L)
 
-Cache cache;
+void *thread(void *vargsp);
+void *acceptor(void *vargp);
+void *stats_thread(void *vargp);
+void print_stats();
+void save_snapshot();
+int doit(int connfd, rio_t *rio);
+int forward(int connfd, char *hostname, int port, char *endserver_http_header, char *version,
+            char *url, int keep_alive, flight_t *flight, cache_obj *stale, int gzip_ok, int *complete);
+int follow(int connfd, flight_t *f, int keep_alive);
+int send_cached(int fd, cache_obj *obj, int gzip_ok, int *keep_alive);
+size_t gzip_headers(char *hdrs, size_t hdrlen, size_t len);
+int accepts_gzip(char *http_header);
+int send_response(int fd, char *hdrs, size_t hdrlen, char *body, size_t bodylen, int *keep_alive);
+char *find_header(char *hdrs, size_t len, const char *name);
+void add_validators(char *http_header, cache_obj *stale);
+unsigned long since_us(struct timespec *start);
+int header_has(char *line, const char *token);
+ssize_t read_response_hdrs(rio_t *rp, char *buf, size_t maxlen, resp_info_t *resp);
+size_t remove_header(char *hdrs, size_t hdrlen, size_t total, const char *name);
+size_t dechunk_cached(char *obj, size_t *hdrlen, size_t len);
+void out_commit(out_t *o, size_t n, int cache);
+int out_flush(out_t *o);
+int relay_body(rio_t *rp, out_t *o, long len);
+int relay_chunked(rio_t *rp, out_t *o, int raw);
+int relay_rest(rio_t *server_rio, int connfd, size_t len);
+void parse_uri(char *uri, char *hostname, char *path, int *port);
+int build_http_header(char *http_header, char *hostname, char *path, int port, rio_t *client_rio, int *keep_alive);
+int connect_endServer(char *hostname, int port, char *http_header);
 
+sbuf_t sbuf; /* shared buffer of connected descriptors */
+int keepalive_timeout = KEEPALIVE_TIMEOUT;
+int connect_timeout = CONNECT_TIMEOUT;
+int pool_max_idle = POOL_MAX_IDLE; /* 0이면 end server와 connection을 유지하지 않는다 */
+size_t cache_bytes = MAX_CACHE_SIZE; /* cache byte 예산 (-m) */
+int cache_shards = CACHE_SHARDS; /* cache shard 수 (-s) */
+const cache_policy *cache_policy_opt = &policy_lru; /* eviction policy (-e) */
+int cache_ttl = FRESH_DEFAULT_TTL; /* freshness 정보가 없는 응답을 fresh로 볼 시간 (-T) */
+char *disk_dir = NULL; /* 쫒겨난 객체를 받는 disk tier의 segment 디렉터리 (-D). 없으면 disk tier를 안 쓴다 */
+size_t disk_bytes = DISK_MAX_BYTES; /* disk tier byte 예산 (-B) */
+int cache_compress = 0; /* text body를 압축해서 넣는다 (-z) */
+int cache_hugepages = 0; /* 객체 slab arena를 transparent huge page로 잡는다 (-H) */
+char *key_strip = NULL; /* cache key에서 뺄 query parameter 이름들, 쉼표로 구분. 끝이 *면 prefix (-Q) */
+int key_sort = 0; /* cache key의 query parameter를 이름 순으로 정렬한다 (-O) */
+char *snapshot_path = NULL; /* 시작할 때 읽고 SIGUSR2, SIGTERM, SIGINT에 cache를 써 두는 snapshot 파일 (-S) */
 
 int main(int argc, char **argv) {
-  int listenfd, connfd;
-  socklen_t clientlen;
-  char hostname[MAXLINE], port[MAXLINE];
+  int listenfd, opt, i;
+  int nthreads = NTHREADS, sbufsize = SBUFSIZE, nacceptors = 0;
+  int pool_per_host = POOL_MAX_PER_HOST, dns_ttl = DNS_TTL;
   pthread_t tid;
-  struct sockaddr_storage clientaddr;
-
-  cache_init(); 
+  sigset_t mask;
 
-  if (argc != 2) {
+  while ((opt = getopt(argc, argv, "t:q:r:k:p:P:d:c:m:s:e:T:D:B:S:zHQ:O")) != -1) {
+    switch (opt) {
+    case 't': nthreads = atoi(optarg); break;
+    case 'q': sbufsize = atoi(optarg); break;
+    case 'r': nacceptors = atoi(optarg); break;
+    case 'k': keepalive_timeout = atoi(optarg); break;
+    case 'p': pool_max_idle = atoi(optarg); break;
+    case 'P': pool_per_host = atoi(optarg); break;
+    case 'd': dns_ttl = atoi(optarg); break;
+    case 'c': connect_timeout = atoi(optarg); break;
+    case 'm': cache_bytes = strtoul(optarg, NULL, 10); break;
+    case 's': cache_shards = atoi(optarg); break;
+    case 'e': cache_policy_opt = policy_find(optarg); break;
+    case 'T': cache_ttl = atoi(optarg); break;
+    case 'D': disk_dir = optarg; break;
+    case 'B': disk_bytes = strtoul(optarg, NULL, 10); break;
+    case 'S': snapshot_path = optarg; break;
+    case 'z': cache_compress = 1; break;
+    case 'H': cache_hugepages = 1; break;
+    case 'Q': key_strip = optarg; break;
+    case 'O': key_sort = 1; break;
+    default: optind = argc + 1; break; /* usage 출력 */
+    }
+  }
+  if (optind != argc - 1 || nthreads < 1 || sbufsize < 1 || nacceptors < 0 || keepalive_timeout < 0
+      || pool_max_idle < 0 || pool_per_host < 1 || dns_ttl < 0
+      || connect_timeout < 0 || cache_bytes == 0 || cache_shards < 1 || cache_policy_opt == NULL
+      || cache_ttl < 0 || disk_bytes == 0) {
     // fprintf: 출력을 파일에다 씀. strerr: 파일 포인터
-    fprintf(stderr, "usage: %s <port> \n", argv[0]);
+    fprintf(stderr, "usage: %s [-t threads] [-q queue] [-r acceptors] [-k idle secs] [-p pool idle] [-P pool per host] [-d dns ttl] [-c connect ms] [-m cache bytes] [-s cache shards] [-e %s] [-T default ttl] [-D disk dir] [-B disk bytes] [-S snapshot] [-z] [-H] [-Q strip params] [-O] <port> \n", argv[0], policy_names());
     exit(1);  // exit(1): 에러 시 강제 종료
   }
   Signal(SIGPIPE, SIG_IGN); // 특정 클라가 종료되어있다고 해서 남은 클라에 영향가지않게 그 한쪽 종료됐다는 시그널을 무시해라.
@@ -85,110 +150,848 @@ int main(int argc, char **argv) {
     하지만 이 프로세스는 현재 다른 여러 클라이언트들과도 연결되어있는 상태기 때문에 하나 종료됐다고 해서 다 꺼버리면 안되니까
     그런 시그널을 무시해라, 라는 함수. SIG_IGN : signal ignore */
 
-  listenfd = Open_listenfd(argv[1]);
+  /* SIGUSR1은 stats_thread만 sigwait으로 받는다. 이후 만드는 쓰레드는 mask를 물려받는다.
+     snapshot을 쓰면 SIGUSR2와 종료 signal도 그 쓰레드가 받아서 cache를 써 둔다 */
+  Sigemptyset(&mask);
+  Sigaddset(&mask, SIGUSR1);
+  if (snapshot_path) {
+    Sigaddset(&mask, SIGUSR2);
+    Sigaddset(&mask, SIGTERM);
+    Sigaddset(&mask, SIGINT);
+  }
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+  if (disk_dir)
+    diskcache_init(disk_dir, disk_bytes);
+  slab_init(cache_bytes, cache_hugepages);
+  cachekey_init(key_strip, key_sort);
+  cache_init(cache_bytes, cache_shards, cache_policy_opt, cache_ttl, cache_compress);
+  if (snapshot_path)
+    cache_load(snapshot_path); /* listener는 기다리지 않고 연다 */
+  connpool_init(pool_max_idle, pool_per_host, POOL_IDLE_SECS);
+  dnscache_init(dns_ttl, dns_ttl ? DNS_NEG_TTL : 0);
+  collapse_init();
+  Pthread_create(&tid, NULL, stats_thread, NULL);
+
+  /* 쓰레드를 connection마다 만들지 않고 미리 nthreads개 만들어 둔다 (prethreading) */
+  sbuf_init(&sbuf, sbufsize);
+  for (i = 0; i < nthreads; i++)
+    Pthread_create(&tid, NULL, thread, NULL);
+
+  /* -r N: SO_REUSEPORT 듣기 소켓을 N개 열고 acceptor 쓰레드가 하나씩 맡는다.
+     kernel이 새 connection을 소켓들에 나눠주니까 accept 쪽이 코어 수만큼 늘어난다 */
+  if (nacceptors == 0) {
+    listenfd = Open_listenfd(argv[optind]);
+  } else {
+    for (i = 1; i < nacceptors; i++)
+      Pthread_create(&tid, NULL, acceptor, (void *)(long)Open_listenfd_reuseport(argv[optind]));
+    listenfd = Open_listenfd_reuseport(argv[optind]);
+  }
+  acceptor((void *)(long)listenfd);
+  return 0;
+}
+
+/* 자기 듣기 소켓에서 accept해서 worker 큐에 넣는다 */
+void *acceptor(void *vargp) {
+  int listenfd = (int)(long)vargp, connfd;
+  socklen_t clientlen;
+  char hostname[MAXLINE], port[MAXLINE];
+  struct sockaddr_storage clientaddr;
+
   while (1) {
     clientlen = sizeof(clientaddr);
     connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
 
-    Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
+    /* 역방향 DNS 조회는 accept 루프를 막으니까 숫자 그대로 찍는다 */
+    Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE,
+                NI_NUMERICHOST | NI_NUMERICSERV);
     printf("Accepted connection from (%s %s).\n", hostname, port);
 
-    // 첫 번째 인자 *thread: 쓰레드 식별자 / 두 번째: 쓰레드 특성 지정 (기본: NULL) / 세 번째: 쓰레드 함수 / 네 번째: 쓰레드 함수의 매개변수
-    Pthread_create(&tid, NULL, thread, (void *)connfd);
-    // doit(connfd);
-    // Close(connfd);
+    /* 큐가 꽉 차 있으면 여기서 기다린다. 그동안 새 connection은 listen 큐에 쌓인다 */
+    sbuf_insert(&sbuf, connfd);
   }
-  return 0;
+  return NULL;
 }
 
+/* worker: 큐에서 connfd를 하나씩 꺼내서 처리한다. keep-alive면 client가 닫거나
+   idle timeout이 지날 때까지 같은 connfd에서 요청을 계속 받는다 */
 void *thread(void *vargsp) {
-  int connfd = (int)vargsp;
+  struct timeval tv;
+  rio_t rio;
+
   Pthread_detach(pthread_self());
-  doit(connfd);
-  Close(connfd);
+  tv.tv_sec = keepalive_timeout;
+  tv.tv_usec = 0;
+  while (1) {
+    int connfd = sbuf_remove(&sbuf);
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    Rio_readinitb(&rio, connfd);
+    while (doit(connfd, &rio))
+      ;
+    Close(connfd);
+  }
+  return NULL;
 }
 
-void doit(int connfd) {
-  int end_serverfd;
+/* kill -USR1 <pid> 하면 pool 크기를 정할 때 쓸 통계를 출력한다 */
+void *stats_thread(void *vargp) {
+  sigset_t mask;
+  int sig;
+
+  Pthread_detach(pthread_self());
+  Sigemptyset(&mask);
+  Sigaddset(&mask, SIGUSR1);
+  if (snapshot_path) {
+    Sigaddset(&mask, SIGUSR2);
+    Sigaddset(&mask, SIGTERM);
+    Sigaddset(&mask, SIGINT);
+  }
+  while (1) {
+    if (sigwait(&mask, &sig) != 0)
+      continue;
+    if (sig == SIGUSR1) {
+      print_stats();
+      continue;
+    }
+    save_snapshot();
+    if (sig != SIGUSR2)
+      exit(0);
+  }
+  return NULL;
+}
 
+/* cache를 snapshot_path에 쓴다 */
+void save_snapshot() {
+  struct timespec start;
+  int n;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if ((n = cache_save(snapshot_path)) < 0)
+    fprintf(stderr, "snapshot: cannot write %s: %s\n", snapshot_path, strerror(errno));
+  else
+    printf("snapshot: saved %d objects to %s in %.3f ms\n", n, snapshot_path, since_us(&start) / 1000.0);
+  fflush(stdout);
+}
+
+void print_stats() {
+  sbuf_stats_t st;
+  connpool_stats_t ps;
+  dnscache_stats_t ds;
+  collapse_stats_t cs;
+  relay_stats_t rs;
+  cache_stats_t cst;
+  diskcache_stats_t dst;
+  slab_stats_t sst;
+  size_t held;
+  int i;
+
+  sbuf_stats(&sbuf, &st);
+  printf("queue: depth %d/%d (max %d), inserted %lu, removed %lu\n",
+         st.depth, st.n, st.max_depth, st.inserted, st.removed);
+  printf("queue: full %lu times, accept blocked %.3f ms, wait avg %.3f ms, max %.3f ms\n",
+         st.full, st.blocked_us / 1000.0,
+         st.removed ? st.wait_us / 1000.0 / st.removed : 0.0,
+         st.max_wait_us / 1000.0);
+  cache_stats(&cst);
+  printf("cache: %d objects, %lu/%lu bytes, %lu evictions, %d shards\n",
+         cst.objects, (unsigned long)cst.bytes, (unsigned long)cst.max_bytes, cst.evictions, cst.shards);
+  printf("cache: %s, hits %lu, misses %lu, hit ratio %.2f%%, saved origin time %.3f s\n",
+         cst.policy, cst.hits, cst.misses,
+         cst.hits + cst.misses ? 100.0 * cst.hits / (cst.hits + cst.misses) : 0.0, cst.saved_us / 1e6);
+  printf("cache: expired %lu, revalidated %lu\n", cst.expired, cst.revalidated);
+  if (cache_compress)
+    printf("compression: %lu objects, %lu -> %lu bytes (%.2fx), compress cpu %.3f ms, "
+           "decompressed %lu hits in %.3f ms cpu, sent gzip %lu\n",
+           cst.zobjs, cst.zraw, cst.zstored, cst.zstored ? (double)cst.zraw / cst.zstored : 0.0,
+           cst.zcpu_us / 1000.0, cst.unzips, cst.unzip_us / 1000.0, cst.gzip_sent);
+  /* class마다 utilization은 받은 page 중 요청된 bytes, fragmentation은 내준 chunk 중 남는 bytes */
+  slab_stats(&sst);
+  printf("slab: %d/%d pages of %d KB free, huge pages %s, reassigned %lu, larger than a page %lu\n",
+         sst.free_pages, sst.pages, SLAB_PAGE_SIZE >> 10, sst.hugepages ? "on" : "off", sst.reassigned, sst.large);
+  for (i = 0; i < sst.nclasses; i++) {
+    if (sst.cls[i].allocs == 0)
+      continue;
+    held = sst.cls[i].used * sst.cls[i].size;
+    printf("slab: class %2d %6lu B, %d pages, %lu/%lu chunks, utilization %.1f%%, fragmentation %.1f%%, "
+           "allocs %lu, fallbacks %lu\n",
+           i, (unsigned long)sst.cls[i].size, sst.cls[i].pages, sst.cls[i].used, sst.cls[i].total,
+           sst.cls[i].pages ? 100.0 * sst.cls[i].requested / ((size_t)sst.cls[i].pages * SLAB_PAGE_SIZE) : 0.0,
+           held ? 100.0 * (held - sst.cls[i].requested) / held : 0.0, sst.cls[i].allocs, sst.cls[i].fallbacks);
+  }
+  diskcache_stats(&dst);
+  if (dst.enabled)
+    printf("disk: %d objects, %lu/%lu bytes, %d/%d segments free, hits %lu, misses %lu, writes %lu, "
+           "compactions %lu, relocated %lu, dropped %lu\n",
+           dst.entries, (unsigned long)dst.live_bytes, (unsigned long)dst.max_bytes, dst.free_segs, dst.segments,
+           dst.hits, dst.misses, dst.writes, dst.compactions, dst.relocated, dst.dropped);
+  connpool_stats(&ps);
+  printf("pool: idle %d, reused %lu, missed %lu, stale %lu, parked %lu, dropped %lu\n",
+         ps.idle, ps.reused, ps.missed, ps.stale, ps.parked, ps.dropped);
+  dnscache_stats(&ds);
+  printf("dns: entries %d, hits %lu, negative hits %lu, misses %lu, joined %lu, failures %lu\n",
+         ds.entries, ds.hits, ds.neg_hits, ds.misses, ds.joined, ds.failures);
+  collapse_stats(&cs);
+  printf("collapse: in flight %d, leaders %lu, followers %lu, fallbacks %lu, aborted %lu\n",
+         cs.inflight, cs.leaders, cs.followers, cs.fallbacks, cs.aborted);
+  relay_stats(&rs);
+  printf("splice: %lu bodies, %lu bytes\n", rs.relays, rs.bytes);
+  fflush(stdout);
+}
+
+/* 요청 하나를 처리한다. 같은 connection에서 다음 요청을 받아도 되면 1, 닫아야 하면 0 */
+int doit(int connfd, rio_t *rio) {
   char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
   char endserver_http_header[MAXLINE];
   char hostname[MAXLINE], path[MAXLINE];
-  int port;
-  
-  // rio: client's rio / server_rio: endserver's rio
-  rio_t rio, server_rio;
+  int port, keep_alive;
 
-  Rio_readinitb(&rio, connfd);
-  Rio_readlineb(&rio, buf, MAXLINE);
-  sscanf(buf, "%s %s %s", method, uri, version);  // read the client reqeust line
+  /* EOF, 오류, idle timeout(SO_RCVTIMEO)이면 connection을 닫는다 */
+  if (rio_readlineb(rio, buf, MAXLINE) <= 0)
+    return 0;
+  if (sscanf(buf, "%s %s %s", method, uri, version) != 3)  // read the client reqeust line
+    return 0;
 
   if (strcasecmp(method, "GET")) {
     printf("Proxy does not implement the method");
-    return;
+    return 0;
   }
   
-  char url_store[100]; // 아직 doit 함수 ㅎㅎ 
-  strcpy(url_store, uri); // doit으로 받아온 connfd가 들고있는 uri를 넣어준다
+  /* cache는 uri를 정규화한 key로 찾는다 (Host:80/a, host/a, host/a#frag는 같은 객체). 길이 제한은 없다.
+     fragment는 end server에 보내지 않는다 */
+  cachekey_t *key = cachekey_make(uri);
+  uri[strcspn(uri, "#")] = '\0';
+
+  // parse the uri to get hostname, file path, port
+  parse_uri(uri, hostname, path, &port);
+
+  /* HTTP/1.1은 기본이 keep-alive, 1.0은 기본이 close. Connection header가 있으면 그걸 따른다.
+     cache hit이어도 다음 요청을 읽으려면 header를 끝까지 읽어둬야 해서 먼저 읽는다 */
+  keep_alive = keepalive_timeout > 0 && !strcasecmp(version, "HTTP/1.1");
+  // build the http header which will send to the end server
+  if (build_http_header(endserver_http_header, hostname, path, port, rio, &keep_alive) < 0) {
+    Free(key);
+    return 0;
+  }
+  if (keepalive_timeout == 0)
+    keep_alive = 0;
 
   // the url is cached?
-  int cache_index;
+  cache_obj *cached, *stale = NULL;
+  int leader = 0, complete, fresh, gzip_ok;
+  flight_t *flight = NULL;
+  gzip_ok = accepts_gzip(endserver_http_header); /* 압축해 둔 객체를 그대로 보내도 되는가 */
   // in cache then return the cache content
-  // cache_index정수 선언, url_store에 있는 인덱스를 뒤짐(chche_find:10개의 캐시블럭) 뒤져서 나온 인덱스가 -1이 아니면
-  if ((cache_index=cache_find(url_store)) != -1) { // 아니면 -> 내가 url_store에 들어있는 캐쉬인덱스에 접근을 했다는 것 
-    readerPre(cache_index); // 캐시 뮤텍스를 풀어줌 (열어줌 0->1)
-    Rio_writen(connfd, cache.cacheobjs[cache_index].cache_obj, strlen(cache.cacheobjs[cache_index].cache_obj));
+  // cache_index정수 선언, key로 인덱스를 뒤짐(chche_find:10개의 캐시블럭) 뒤져서 나온 인덱스가 -1이 아니면
+  /* 없으면 같은 URL을 다른 쓰레드가 벌써 가지러 갔는지 본다. 갔으면 end server에 또 가지 않고
+     그 쓰레드가 받는 중인 응답을 받는 대로 따라 보낸다 (collapsed forwarding) */
+  /* cache_lookup은 찾은 객체를 pin 해서 돌려준다. 보내는 동안 lock은 잡고 있지 않다.
+     stale한 객체는 miss처럼 end server에 가되 leader가 revalidate 할 때 쓴다 */
+  if ((cached = cache_lookup(key->s, &fresh)) == NULL || !fresh) {
+    if (cached)
+      cache_release(cached);
+    flight = collapse_begin(key->s, &leader);
+    if (!leader) {
+      complete = follow(connfd, flight, keep_alive);
+      flight_release(flight);
+      if (complete >= 0) {
+        Free(key);
+        return complete;
+      }
+      flight = NULL; /* 따라갈 수 없는 응답이었다 */
+    }
+    /* 그 사이 앞선 leader가 막 넣었거나 revalidate 했을 수 있다 */
+    cached = cache_recheck(key->s, &fresh);
+  }
+  if (cached != NULL && !fresh) {
+    stale = cached;
+    cached = NULL;
+  }
+  if (cached != NULL) { // 아니면 -> 내가 key에 해당하는 캐쉬 객체를 찾았다는 것
+    if (send_cached(connfd, cached, gzip_ok, &keep_alive) < 0)
+      keep_alive = 0;
     // 캐시에서 찾은 값을 connfd에 쓰고, 캐시에서 그 값을 바로 보내게 됨
-    readerAfter(cache_index); // 닫아줌 1->0 doit 끝
-    return;
+    cache_release(cached); // pin을 놓음. 그 사이 쫒겨났으면 여기서 free 된다
+    if (flight)
+      collapse_end(flight, 0); /* leader가 되자마자 cache에서 찾았다. 따라온 요청들은 cache로 간다 */
+    Free(key);
+    return keep_alive;
   }
-  
-  // parse the uri to get hostname, file path, port
-  parse_uri(uri, hostname, path, &port);
 
-  // build the http header which will send to the end server
-  build_http_header(endserver_http_header, hostname, path, port, &rio);
+  /* client가 직접 조건부 요청이나 Range를 보냈으면 그 답을 우리 304로 오해하지 않게 revalidate 하지 않는다 */
+  if (stale && (find_header(endserver_http_header, strlen(endserver_http_header), "If-None-Match")
+                || find_header(endserver_http_header, strlen(endserver_http_header), "If-Modified-Since")
+                || find_header(endserver_http_header, strlen(endserver_http_header), "Range"))) {
+    cache_release(stale);
+    stale = NULL;
+  }
+
+  /* leader면 끝나고 flight를 닫는다. 끝까지 못 받았으면 따라 보내던 요청들은 끊긴다 */
+  keep_alive = forward(connfd, hostname, port, endserver_http_header, version, key->s,
+                       keep_alive, flight, stale, gzip_ok, &complete);
+  if (stale)
+    cache_release(stale);
+  if (flight)
+    collapse_end(flight, complete);
+  Free(key);
+  return keep_alive;
+}
+
+/* leader의 flight에서 응답을 읽어 보낸다. leader가 받는 대로 보내서 다 받을 때까지 기다리지 않는다.
+   반환값은 doit과 같고, leader가 header를 넘기기 전에 포기했으면 -1 (직접 가지러 가야 한다) */
+int follow(int connfd, flight_t *f, int keep_alive) {
+  ssize_t hdrlen, n;
+  size_t off;
+  char *data;
+
+  if ((hdrlen = flight_wait_headers(f)) < 0)
+    return -1;
+  /* header는 한 번에 붙으니까 첫 조각에 다 있다 */
+  if ((n = flight_read(f, 0, &data)) < hdrlen)
+    return 0;
+  if (send_response(connfd, data, hdrlen, data + hdrlen, n - hdrlen, &keep_alive) < 0)
+    return 0;
+  for (off = n; (n = flight_read(f, off, &data)) > 0; off += n)
+    if (rio_writen(connfd, data, n) < 0)
+      return 0;
+  return n == 0 ? keep_alive : 0;
+}
+
+/* end server에 요청을 보내고 응답을 client로 넘긴다. 끝까지 받았고 넣을 수 있으면 url로 cache에
+   넣는다. stale이 있으면 그 validator로 조건부 요청을 보내고, 304가 오면 body는 받지 않고
+   stale을 refresh 해서 보낸다. 반환값은 doit과 같다 */
+int forward(int connfd, char *hostname, int port, char *endserver_http_header, char *version,
+            char *url, int keep_alive, flight_t *flight, cache_obj *stale, int gzip_ok, int *complete) {
+  int end_serverfd;
+  // server_rio: endserver's rio (client rio는 keep-alive 동안 유지돼야 해서 thread가 들고 있다)
+  rio_t server_rio;
 
   // connect to the end server
-  end_serverfd = connect_endServer(hostname, port, endserver_http_header);
-  if (end_serverfd < 0) {
-    printf("connection failed\n");
-    return;
-  }
+  char cachebuf[MAX_OBJECT_SIZE];
+  out_t out;
+  resp_info_t resp;
+  long body_len;
+  ssize_t n;
+  int reused, dechunk, attempt;
+  size_t hdrlen;
+  struct timespec start; /* 가져오는 데 걸린 시간을 cache의 policy가 비용으로 쓴다 */
+  unsigned long fetch_us;
+
+  *complete = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (stale)
+    add_validators(endserver_http_header, stale);
 
-  Rio_readinitb(&server_rio, end_serverfd);
+  /* pool에 살아 있는 connection이 있으면 그걸 쓴다. 보냈는데 응답 header도 못 받았으면
+     그 사이 end server가 닫은 것이니 새로 connect해서 한 번 더 보낸다 (GET이라 다시 보내도 된다) */
+  for (attempt = 0; ; attempt++) {
+    reused = 0;
+    if (attempt == 0 && pool_max_idle > 0 && (end_serverfd = connpool_get(hostname, port)) >= 0) {
+      reused = 1;
+    } else if ((end_serverfd = connect_endServer(hostname, port, endserver_http_header)) < 0) {
+      printf("connection failed\n");
+      return 0;
+    }
+
+    Rio_readinitb(&server_rio, end_serverfd);
+    out.fd = connfd;
+    out.fill = 0;
+    out.cachelen = 0;
+    out.cachebuf = cachebuf;
+    out.flight = NULL;
+    out.error = 0;
+    out.write_us = 0;
 
-  // write the http header to endserver
-  Rio_writen(end_serverfd, endserver_http_header, strlen(endserver_http_header));
+    // write the http header to endserver
+    /* status line과 header를 먼저 다 읽어서 block에 모아둔다. 아직 client로 안 보냄.
+       뒤에 Connection header를 붙일 자리는 남겨둔다 */
+    if (rio_writen(end_serverfd, endserver_http_header, strlen(endserver_http_header)) >= 0
+        && (n = read_response_hdrs(&server_rio, out.block, BODY_BLOCK - MAXLINE, &resp)) > 0)
+      break;
+    Close(end_serverfd);
+    if (!reused)
+      return 0;
+  }
+
+  /* 가진 것이 그대로라는 답. end server connection은 돌려주고 cache에 있던 body를 보낸다.
+     따라온 요청들은 기다리지 않고 refresh 된 cache로 간다 */
+  if (stale && resp.status == 304) {
+    if (pool_max_idle > 0 && !resp.server_close && server_rio.rio_cnt == 0)
+      connpool_put(hostname, port, end_serverfd);
+    else
+      Close(end_serverfd);
+    cache_refresh(stale, out.block, n);
+    if (flight)
+      flight_noshare(flight);
+    *complete = 1;
+    return send_cached(connfd, stale, gzip_ok, &keep_alive) == 0 && keep_alive;
+  }
 
   // recieve message from end server and send to the client
-  char cachebuf[MAX_OBJECT_SIZE];
-  int sizebuf = 0;
-  size_t n; // 캐시에 없을 때 찾아주는 과정?
-  while ((n=Rio_readlineb(&server_rio, buf, MAXLINE)) != 0) {
-    // printf("proxy received %ld bytes, then send\n", n);
-    sizebuf += n;
-    /* proxy거쳐서 서버에서 response오는데, 그 응답을 저장하고 클라이언트에 보냄 */
-    if (sizebuf < MAX_OBJECT_SIZE) // 작으면 response 내용을 적어놈
-      strcat(cachebuf, buf); // cachebuf에 but(response값) 다 이어붙혀놓음(캐시내용)
-    Rio_writen(connfd, buf, n);
-  }
-  Close(end_serverfd);
+  /* body 길이를 정한다. 끝을 알 수 없으면(close로 끝나는 응답) keep-alive를 못 한다 */
+  if ((resp.status >= 100 && resp.status < 200) || resp.status == 204 || resp.status == 304)
+    body_len = 0;
+  else if (resp.chunked)
+    body_len = BODY_CHUNKED;
+  else
+    body_len = resp.content_length;
+  if (body_len == BODY_TO_EOF)
+    keep_alive = 0;
+
+  /* cache에는 hop-by-hop header를 뺀 원래 header만 넣는다 */
+  out_commit(&out, n, 1);
+
+  /* 따라붙은 요청들에도 같은 header와 body를 넘긴다. chunked는 사본에 chunk를 풀어 모으고
+     FLIGHT_MAX보다 큰 body는 splice로 넘겨서 사본이 없으니 그들은 따로 가지러 간다.
+     cache가 넣지 않을 응답 (private, no-store, 저장할 수 없는 status)도 이 client만의 것이라 나누지 않는다.
+     cache에 못 넣을 만큼 큰 body는 따라붙은 요청이 아직 없으면 나누지 않고 사본 없이 splice로 보낸다 */
+  if (flight) {
+    if (!cache_storable(cachebuf, n) || body_len == BODY_CHUNKED || (body_len >= 0 && body_len > FLIGHT_MAX)) {
+      flight_noshare(flight);
+    } else if (body_len >= 0 && out.cachelen + body_len >= MAX_OBJECT_SIZE && flight_alone(flight)) {
+      /* 혼자다. out.flight가 NULL이라 아래에서 splice로 간다 */
+    } else {
+      flight_headers(flight, cachebuf, n, body_len == BODY_TO_EOF); /* 끝을 모르는 body는 다 받은 뒤에 나눈다 */
+      out.flight = flight;
+    }
+  }
+
+  /* HTTP/1.0 client는 chunked를 모르니까 chunk를 풀어서 보내고 끝은 close로 알린다 */
+  dechunk = body_len == BODY_CHUNKED && strcasecmp(version, "HTTP/1.1");
+  if (dechunk) {
+    keep_alive = 0;
+    out.fill -= remove_header(out.block, out.fill, out.fill, "Transfer-Encoding");
+  }
+
+  /* client에는 Connection header를 붙여 보낸다 */
+  out.fill -= strlen(endof_hdr);
+  out.fill += sprintf(out.block + out.fill, "Connection: %s\r\n%s",
+                      keep_alive ? "keep-alive" : "close", endof_hdr);
+
+  if (body_len == BODY_CHUNKED) {
+    *complete = relay_chunked(&server_rio, &out, !dechunk) == 0;
+  } else if (body_len >= 0 && out.cachelen + body_len >= MAX_OBJECT_SIZE && !out.flight) {
+    /* body가 cache에 못 넣을 만큼 크고 따라오는 요청에 넘길 것도 아니면 header만 보내고 나머지는 splice */
+    out.cachebuf = NULL;
+    *complete = out_flush(&out) == 0 && relay_rest(&server_rio, connfd, body_len) == 0;
+  } else {
+    *complete = relay_body(&server_rio, &out, body_len) == 0;
+  }
+  /* 마지막 byte를 읽은 데서 시계를 멈춘다. 느린 client에 쓰느라 기다린 시간은 end server 비용이 아니다 */
+  fetch_us = since_us(&start) - out.write_us;
+
+  /* 응답을 끝까지 읽었고 end server도 닫지 않겠다고 했으면 다음 요청을 위해 pool에 돌려준다 */
+  if (pool_max_idle > 0 && *complete && !resp.server_close && body_len != BODY_TO_EOF
+      && server_rio.rio_cnt == 0)
+    connpool_put(hostname, port, end_serverfd);
+  else
+    Close(end_serverfd);
 
   // store it
-  if (sizebuf < MAX_OBJECT_SIZE) {
-    cache_uri(url_store, cachebuf); // url_store에 cachebuf 저장
+  /* body를 끝까지 받았을 때만 넣는다. chunked였으면 풀어둔 body에 맞게 Content-length로 바꾼다.
+     header와 body를 길이로 나눠 넣으니까 NUL이 섞인 객체도 된다 */
+  hdrlen = resp.hdrlen;
+  if (*complete && out.cachebuf && resp.chunked)
+    out.cachelen = dechunk_cached(cachebuf, &hdrlen, out.cachelen);
+  if (*complete && out.cachebuf && out.cachelen > 0)
+    cache_uri(url, cachebuf, hdrlen, cachebuf + hdrlen, out.cachelen - hdrlen, fetch_us); // url에 cachebuf 저장
+  return keep_alive && *complete && !out.error;
+}
+
+/* start부터 지금까지 걸린 시간 */
+unsigned long since_us(struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000UL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* stale의 ETag와 Last-Modified로 If-None-Match, If-Modified-Since를 마지막 빈 줄 앞에 붙인다.
+   http_header는 MAXLINE 크기. 자리가 모자라면 붙이지 않는다 (그냥 전체를 다시 받는다) */
+void add_validators(char *http_header, cache_obj *stale) {
+  static const struct { const char *from, *to; } v[] = {
+    { "ETag", "If-None-Match" }, { "Last-Modified", "If-Modified-Since" }
+  };
+  size_t len = strlen(http_header) - strlen(endof_hdr), vlen;
+  const char *val;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if ((val = http_header_value(stale->hdrs, stale->hdrlen, v[i].from, &vlen)) == NULL
+        || len + strlen(v[i].to) + vlen + 4 + strlen(endof_hdr) >= MAXLINE)
+      continue;
+    len += sprintf(http_header + len, "%s: %.*s\r\n", v[i].to, (int)vlen, val);
+  }
+  strcpy(http_header + len, endof_hdr);
+}
+
+/* cache에 있던 응답을 보낸다. pin 한 객체로 부른다. 압축해 둔 객체는 client가 gzip을 받으면
+   Content-Encoding과 압축된 길이로 header를 고쳐 그대로 보내고, 아니면 풀어서 원래 header로 보낸다 */
+int send_cached(int fd, cache_obj *obj, int gzip_ok, int *keep_alive) {
+  char *hdrs = obj->hdrs, *body, *raw;
+  size_t hdrlen = obj->hdrlen, len;
+  int rc;
+
+  if ((body = cache_body(obj, gzip_ok, &len, &raw)) == NULL)
+    return -1;
+  if (obj->gzip && raw == NULL) {
+    hdrs = Malloc(hdrlen + 2 * MAXLINE);
+    memcpy(hdrs, obj->hdrs, hdrlen);
+    hdrlen = gzip_headers(hdrs, hdrlen, len);
+  }
+  rc = send_response(fd, hdrs, hdrlen, body, len, keep_alive);
+  if (hdrs != obj->hdrs)
+    Free(hdrs);
+  if (raw)
+    Free(raw);
+  return rc;
+}
+
+/* hdrs[0..hdrlen)을 압축된 len bytes body에 맞는 header로 고치고 새 길이를 반환한다. hdrs 뒤에는
+   2 * MAXLINE 만큼 자리가 있어야 한다. Vary는 원래 값에 Accept-Encoding을 합쳐 한 줄로 두고,
+   원래 body의 strong ETag를 다른 bytes에 쓰지 않게 "-gzip"을 붙인다 (모양이 이상한 ETag는 뺀다) */
+size_t gzip_headers(char *hdrs, size_t hdrlen, size_t len) {
+  char vary[MAXLINE], etag[MAXLINE];
+  const char *v;
+  size_t vlen;
+
+  vary[0] = etag[0] = '\0';
+  if ((v = http_header_value(hdrs, hdrlen, "Vary", &vlen)) != NULL && vlen < MAXLINE - 32)
+    sprintf(vary, "%.*s", (int)vlen, v);
+  if ((v = http_header_value(hdrs, hdrlen, "ETag", &vlen)) != NULL && vlen >= 2 && v[vlen - 1] == '"'
+      && vlen < MAXLINE - 32)
+    sprintf(etag, "%.*s-gzip\"", (int)vlen - 1, v);
+  hdrlen -= remove_header(hdrs, hdrlen, hdrlen, "Content-length");
+  hdrlen -= remove_header(hdrs, hdrlen, hdrlen, "Vary");
+  hdrlen -= remove_header(hdrs, hdrlen, hdrlen, "ETag");
+  hdrlen -= strlen(endof_hdr);
+  hdrlen += sprintf(hdrs + hdrlen, "Content-Encoding: gzip\r\nContent-length: %lu\r\n", (unsigned long)len);
+  if (etag[0])
+    hdrlen += sprintf(hdrs + hdrlen, "ETag: %s\r\n", etag);
+  if (vary[0] == '\0')
+    hdrlen += sprintf(hdrs + hdrlen, "Vary: Accept-Encoding\r\n");
+  else if (header_has(vary, "accept-encoding"))
+    hdrlen += sprintf(hdrs + hdrlen, "Vary: %s\r\n", vary);
+  else
+    hdrlen += sprintf(hdrs + hdrlen, "Vary: %s, Accept-Encoding\r\n", vary);
+  hdrlen += sprintf(hdrs + hdrlen, "%s", endof_hdr);
+  return hdrlen;
+}
+
+/* client가 보낸 Accept-Encoding에 gzip이 있고 q=0으로 막지 않았는가 */
+int accepts_gzip(char *http_header) {
+  char val[MAXLINE], *line, *p;
+  size_t n, i;
+
+  if ((line = find_header(http_header, strlen(http_header), "Accept-Encoding")) == NULL)
+    return 0;
+  line += strlen("Accept-Encoding:");
+  if ((n = strcspn(line, "\r\n")) >= sizeof(val))
+    n = sizeof(val) - 1;
+  for (i = 0; i < n; i++)
+    val[i] = tolower((unsigned char)line[i]);
+  val[n] = '\0';
+  if ((p = strstr(val, "gzip")) == NULL)
+    return 0;
+  for (p += 4; *p == ' '; p++)
+    ;
+  return !(strncmp(p, ";q=", 3) == 0 && atof(p + 3) == 0);
+}
+
+/* hdrs[0..hdrlen)은 마지막 빈 줄까지의 header. 빈 줄 앞에 Connection header를 끼워서 body까지
+   writev 한 번으로 보낸다. Content-length가 없는 응답이면 끝을 알릴 방법이 close뿐이라 keep-alive를 끈다 */
+int send_response(int fd, char *hdrs, size_t hdrlen, char *body, size_t bodylen, int *keep_alive) {
+  char conn_line[64];
+  struct iovec iov[4];
+  size_t total = 0;
+  ssize_t n;
+  int i;
+
+  if (!find_header(hdrs, hdrlen, "Content-length"))
+    *keep_alive = 0;
+  sprintf(conn_line, "Connection: %s\r\n", *keep_alive ? "keep-alive" : "close");
+
+  iov[0].iov_base = hdrs;
+  iov[0].iov_len = hdrlen - 2;
+  iov[1].iov_base = conn_line;
+  iov[1].iov_len = strlen(conn_line);
+  iov[2].iov_base = hdrs + hdrlen - 2;
+  iov[2].iov_len = 2;
+  iov[3].iov_base = body;
+  iov[3].iov_len = bodylen;
+  for (i = 0; i < 4; i++)
+    total += iov[i].iov_len;
+  while ((n = writev(fd, iov, 4)) < 0 && errno == EINTR)
+    ;
+  if (n < 0)
+    return -1;
+  if ((size_t)n == total)
+    return 0;
+
+  /* 일부만 나갔으면 나머지는 rio_writen으로 마저 보낸다 */
+  for (i = 0; i < 4; i++) {
+    if ((size_t)n >= iov[i].iov_len) {
+      n -= iov[i].iov_len;
+      continue;
+    }
+    if (rio_writen(fd, (char *)iov[i].iov_base + n, iov[i].iov_len - n) < 0)
+      return -1;
+    n = 0;
+  }
+  return 0;
+}
+
+/* hdrs[0..len) 안에 name header가 있으면 그 줄의 시작을 반환한다 */
+char *find_header(char *hdrs, size_t len, const char *name) {
+  size_t namelen = strlen(name);
+  char *line = hdrs, *end = hdrs + len, *eol;
+
+  while (line < end && (eol = memchr(line, '\n', end - line)) != NULL) {
+    if (eol - line > namelen && !strncasecmp(line, name, namelen) && line[namelen] == ':')
+      return line;
+    line = eol + 1;
+  }
+  return NULL;
+}
+
+/* header 한 줄에 token이 (대소문자 무시하고) 들어 있는지 본다 */
+int header_has(char *line, const char *token) {
+  size_t toklen = strlen(token);
+
+  for (; *line; line++)
+    if (!strncasecmp(line, token, toklen))
+      return 1;
+  return 0;
+}
+
+/* status line과 header를 빈 줄까지 읽어서 buf에 모은다. Connection처럼 hop-by-hop인 header는
+   proxy가 다시 붙이니까 뺀다. header 전체 길이를 반환하고, header가 오기 전에 끊기거나 너무 길면 -1 */
+ssize_t read_response_hdrs(rio_t *rp, char *buf, size_t maxlen, resp_info_t *resp) {
+  size_t len = 0;
+  ssize_t n;
+  char *line;
+  int minor = 0, keep = 0, close = 0;
+
+  resp->status = 0;
+  resp->content_length = -1;
+  resp->chunked = 0;
+  while ((n = rio_readlineb(rp, buf + len, maxlen - len)) > 0) {
+    line = buf + len;
+    if (len == 0)
+      sscanf(line, "HTTP/1.%d %d", &minor, &resp->status);
+    else if (!strncasecmp(line, "Content-length:", 15))
+      resp->content_length = atol(line + 15);
+    else if (!strncasecmp(line, "Transfer-encoding:", 18) && header_has(line, "chunked"))
+      resp->chunked = 1;
+    else if (!strncasecmp(line, connection_key, strlen(connection_key))
+             || !strncasecmp(line, proxy_connection_key, strlen(proxy_connection_key))
+             || !strncasecmp(line, "Keep-Alive:", 11)) {
+      if (header_has(line, "close"))
+        close = 1;
+      else if (header_has(line, "keep-alive"))
+        keep = 1;
+      continue; /* 이 줄은 버린다 (len을 안 늘림) */
+    }
+    len += n;
+    if (!strcmp(line, endof_hdr)) {
+      /* HTTP/1.1은 close라고 안 하면 유지, 1.0은 keep-alive라고 해야 유지 */
+      resp->server_close = close || (minor == 0 && !keep);
+      resp->hdrlen = len;
+      return len;
+    }
+    if (len >= maxlen - 1)
+      return -1;
+  }
+  return -1;
+}
+
+/* hdrs[0..hdrlen)에서 name header 줄을 지우고 그 뒤(total까지)를 당긴다. 지운 bytes 수를 반환한다 */
+size_t remove_header(char *hdrs, size_t hdrlen, size_t total, const char *name) {
+  char *line, *eol;
+  size_t removed = 0, linelen;
+
+  while ((line = find_header(hdrs, hdrlen - removed, name)) != NULL) {
+    eol = memchr(line, '\n', hdrs + hdrlen - removed - line);
+    linelen = eol + 1 - line;
+    memmove(line, eol + 1, hdrs + total - removed - (eol + 1));
+    removed += linelen;
+  }
+  return removed;
+}
+
+/* chunk를 풀어서 모은 cache 사본의 header를 Transfer-Encoding 대신 Content-length로 바꾼다.
+   새 길이를 반환하고 *hdrlen도 고친다. 자리가 모자라면 0 */
+size_t dechunk_cached(char *obj, size_t *hdrlen, size_t len) {
+  char cl_line[64];
+  size_t removed, cl_len, body;
+
+  removed = remove_header(obj, *hdrlen, len, "Transfer-Encoding");
+  len -= removed;
+  body = len - (*hdrlen - removed);
+  cl_len = sprintf(cl_line, "Content-length: %lu\r\n", (unsigned long)body);
+  if (len + cl_len >= MAX_OBJECT_SIZE)
+    return 0;
+  *hdrlen -= removed;
+  /* 마지막 빈 줄 앞에 끼운다 */
+  memmove(obj + *hdrlen - 2 + cl_len, obj + *hdrlen - 2, body + 2);
+  memcpy(obj + *hdrlen - 2, cl_line, cl_len);
+  *hdrlen += cl_len;
+  return len + cl_len;
+}
+
+/* out.block[fill..fill+n)에 새로 채운 bytes를 반영한다. cache가 1이면 cache 사본에도 넣고,
+   사본이 MAX_OBJECT_SIZE를 넘게 되면 이 응답은 cache에 안 넣는다 */
+void out_commit(out_t *o, size_t n, int cache) {
+  if (o->flight && cache && flight_append(o->flight, o->block + o->fill, n) < 0)
+    o->flight = NULL;
+  if (o->cachebuf && cache) {
+    if (o->cachelen + n < MAX_OBJECT_SIZE) {
+      memcpy(o->cachebuf + o->cachelen, o->block + o->fill, n);
+      o->cachelen += n;
+    } else {
+      o->cachebuf = NULL;
+    }
+  }
+  o->fill += n;
+}
+
+/* end server에서 바로 더 읽을 게 있는지 (rio 버퍼나 socket에) */
+static int more_pending(rio_t *rp) {
+  char c;
+
+  return rp->rio_cnt > 0 || recv(rp->rio_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+/* 모아둔 bytes를 client로 한 번에 쓴다 */
+int out_flush(out_t *o) {
+  struct timespec start;
+  ssize_t rc;
+
+  if (o->fill == 0)
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  rc = rio_writen(o->fd, o->block, o->fill);
+  o->write_us += since_us(&start);
+  if (rc < 0) {
+    o->error = 1;
+    return -1;
+  }
+  o->fill = 0;
+  return 0;
+}
+
+/* body를 줄 단위가 아니라 큰 덩어리로 옮긴다. len만큼 (BODY_TO_EOF면 end server가 닫을 때까지)
+   읽고, 길이를 알면 block이 차거나 body가 끝날 때까지 모았다가 한 번에 쓴다.
+   body를 끝까지 넘겼으면 0, 중간에 끊겼으면 -1 */
+int relay_body(rio_t *rp, out_t *o, long len) {
+  size_t want;
+  ssize_t n;
+
+  while (len != 0) {
+    if (len == BODY_TO_EOF && o->cachebuf == NULL && (o->flight == NULL || flight_alone(o->flight))) {
+      /* 크기를 모르는데 cache에도 못 넣고 기다리는 요청도 없다. 나머지는 splice */
+      o->flight = NULL;
+      if (out_flush(o) < 0)
+        return -1;
+      return relay_rest(rp, o->fd, RELAY_TO_EOF);
+    }
+    want = BODY_BLOCK - o->fill;
+    if (len > 0 && len < want)
+      want = len;
+    if ((n = rio_readsomeb(rp, o->block + o->fill, want)) <= 0) {
+      if (out_flush(o) < 0)
+        return -1;
+      return (len == BODY_TO_EOF && n == 0) ? 0 : -1;
+    }
+    out_commit(o, n, 1);
+    if (len > 0)
+      len -= n;
+    /* block이 안 찼어도 end server가 더 보낸 게 없으면 지금까지 온 걸 먼저 보낸다.
+       느린 end server 뒤에서 client가 64KB가 찰 때까지 기다리지 않게 */
+    if ((len <= 0 || o->fill == BODY_BLOCK || ((size_t)n < want && !more_pending(rp))) && out_flush(o) < 0)
+      return -1;
+  }
+  return out_flush(o);
+}
+
+/* chunk 크기 줄, chunk 뒤 CRLF, trailer 같은 한 줄을 읽는다. raw면 client로 넘기고 아니면 버린다.
+   어느 쪽이든 cache 사본에는 안 넣는다 */
+static ssize_t chunk_line(rio_t *rp, out_t *o, int raw, char *line) {
+  ssize_t n;
+
+  if (o->fill + MAXLINE > BODY_BLOCK && out_flush(o) < 0)
+    return -1;
+  if ((n = rio_readlineb(rp, o->block + o->fill, MAXLINE)) <= 0)
+    return -1;
+  memcpy(line, o->block + o->fill, n + 1);
+  if (raw)
+    out_commit(o, n, 0);
+  return n;
+}
+
+/* Transfer-Encoding: chunked 응답을 넘긴다. chunk 크기를 읽어서 어디서 끝나는지 안다.
+   raw면 chunk 형식 그대로, 아니면 데이터만 넘긴다. cache 사본에는 데이터만 모은다 */
+int relay_chunked(rio_t *rp, out_t *o, int raw) {
+  char line[MAXLINE];
+  long size;
+
+  while (1) {
+    if (chunk_line(rp, o, raw, line) < 0)
+      return -1;
+    size = strtol(line, NULL, 16);
+
+    if (size == 0) {
+      /* 마지막 chunk 뒤 trailer는 빈 줄까지 */
+      do {
+        if (chunk_line(rp, o, raw, line) < 0)
+          return -1;
+      } while (strcmp(line, endof_hdr));
+      return out_flush(o);
+    }
+    if (size < 0 || relay_body(rp, o, size) < 0)
+      return -1;
+
+    /* chunk 데이터 뒤의 CRLF */
+    if (chunk_line(rp, o, raw, line) < 0)
+      return -1;
   }
 }
 
-void build_http_header(char *http_header, char *hostname, char *path, int port, rio_t *client_rio) {
+/* cache에 안 넣을 body의 나머지 len bytes(RELAY_TO_EOF면 끝까지)를 user space를
+   거치지 않고 넘긴다. rio 버퍼에 이미 읽어둔 bytes가 있으면 그것부터 보낸다 */
+int relay_rest(rio_t *server_rio, int connfd, size_t len) {
+  size_t n = server_rio->rio_cnt < len ? server_rio->rio_cnt : len;
+  ssize_t rc;
+
+  if (n > 0) {
+    if (rio_writen(connfd, server_rio->rio_bufptr, n) < 0)
+      return -1;
+    server_rio->rio_bufptr += n;
+    server_rio->rio_cnt -= n;
+    if (len != RELAY_TO_EOF)
+      len -= n;
+  }
+  if (len == 0)
+    return 0;
+  if ((rc = splice_relay(server_rio->rio_fd, connfd, len)) < 0) {
+    fprintf(stderr, "splice_relay error: %s\n", strerror(errno));
+    return -1;
+  }
+  return (len == RELAY_TO_EOF || (size_t)rc == len) ? 0 : -1;
+}
+
+/* client가 보낸 header를 읽어서 end server로 보낼 요청을 만든다. Connection/Proxy-Connection
+   header가 있으면 client connection을 유지할지(*keep_alive)를 거기에 맞춘다 */
+int build_http_header(char *http_header, char *hostname, char *path, int port, rio_t *client_rio, int *keep_alive) {
   char buf[MAXLINE], request_hdr[MAXLINE], other_hdr[MAXLINE], host_hdr[MAXLINE];
+  ssize_t n;
+
+  host_hdr[0] = '\0';
+  other_hdr[0] = '\0';
   
   // request line
-  sprintf(request_hdr, requestline_hdr_format, path);
+  sprintf(request_hdr, pool_max_idle > 0 ? requestline_keep_format : requestline_hdr_format, path);
 
   // get other request header for client rio and change it
-  while (Rio_readlineb(client_rio, buf, MAXLINE) > 0) {
+  while ((n = rio_readlineb(client_rio, buf, MAXLINE)) > 0) {
     if (strcmp(buf, endof_hdr) == 0)
       break;  // EOF
     
@@ -197,36 +1000,49 @@ void build_http_header(char *http_header, char *hostname, char *path, int port,
       continue;
     }
 
-    if (strncasecmp(buf, connection_key, strlen(connection_key))
-        &&strncasecmp(buf, proxy_connection_key, strlen(proxy_connection_key))
-        &&strncasecmp(buf, user_agent_key, strlen(user_agent_key))) {
+    if (!strncasecmp(buf, connection_key, strlen(connection_key))
+        || !strncasecmp(buf, proxy_connection_key, strlen(proxy_connection_key))) {
+      if (header_has(buf, "close"))
+        *keep_alive = 0;
+      else if (header_has(buf, "keep-alive"))
+        *keep_alive = 1;
+      continue;
+    }
+
+    if (strncasecmp(buf, user_agent_key, strlen(user_agent_key))
+        && strlen(other_hdr) + n < MAXLINE) {
         strcat(other_hdr, buf);
       }
   }
+  if (n <= 0)
+    return -1;
   if (strlen(host_hdr) == 0) {
     sprintf(host_hdr, host_hdr_format, hostname);
   }
   sprintf(http_header, "%s%s%s%s%s%s%s",
           request_hdr,
           host_hdr,
-          conn_hdr,
-          prox_hdr,
+          pool_max_idle > 0 ? conn_keep_hdr : conn_hdr,
+          pool_max_idle > 0 ? "" : prox_hdr,
           user_agent_hdr,
           other_hdr,
           endof_hdr);
-  return;
+  return 0;
 }
 
 // Connect to the end server
 inline int connect_endServer(char *hostname, int port, char *http_header) {
   char portStr[100];
   sprintf(portStr, "%d", port);
-  return Open_clientfd(hostname, portStr);
+  /* 이름 풀이는 cache에서. 주소들을 동시에 시도해서 제일 먼저 붙는 걸 쓰고, connect_timeout 안에
+     안 붙으면 포기한다. 실패해도 proxy 전체가 죽지 않는다 */
+  return dns_open_clientfd(hostname, portStr, connect_timeout);
 }
 
 // parse the uri to get hostname, file path, port
 void parse_uri(char *uri, char *hostname, char *path, int *port) {
   *port = 80;
+  strcpy(path, "/");
   char *pos = strstr(uri, "//");
 
   pos = pos!=NULL? pos+2:uri;
@@ -245,150 +1061,8 @@ void parse_uri(char *uri, char *hostname, char *path, int *port) {
       *pos2 = '/';
       sscanf(pos2, "%s", path);
     } else {
-      scanf(pos, "%s", hostname);
+      sscanf(pos, "%s", hostname);
     }
   }
   return;
 }
-
-void cache_init() {
-  cache.cache_num = 0; // 맨 처음이니까
-  int i;
-  for (i=0; i<CACHE_OBJS_COUNT; i++) {
-    cache.cacheobjs[i].LRU = 0; // LRU : 우선 순위를 미는 것. 처음이니까 0
-    cache.cacheobjs[i].isEmpty = 1; // 1이 비어있다는 뜻
-
-    // Sem_init : 세마포어 함수 
-    // 첫 번째 인자: 초기화할 세마포어의 포인터 / 두 번째: 0 - 쓰레드들끼리 세마포어 공유, 그 외 - 프로세스 간 공유 / 세 번째: 초기 값
-    //    뮤텍스 만들 포인터 / 0 : 세마포어를 뮤텍스로 쓰려면 0을 써야 쓰레드끼리 사용하는거라고 표시하는 것이 됨 / 1 : 초깃값 
-    // 세마포어는 프로세스를 쓰는 것. 지금 세마포어를 쓰레드에 적용하고 싶으니까 0을 써서 쓰레드에서 쓰는거라고 표시, 나머지 숫자를 프로세스에서 쓰는거라는 표시.
-    Sem_init(&cache.cacheobjs[i].wmutex, 0, 1); // wmutex : 캐시에 접근하는 것을 프로텍트해주는 뮤텍스
-    Sem_init(&cache.cacheobjs[i].rdcntmutex, 0, 1); // read count mutex : 리드카운트에 접근하는걸 프로텍트해주는 뮤텍스
-    // ㄴ flag 지정
-    cache.cacheobjs[i].readCnt = 0; // read count를 0으로 놓고 init을 끝냄
-  }
-}
-
-void readerPre(int i) { // i = 해당인덱스
-  // 내가 받아온 index오브젝트의 리드카운트 뮤텍스를 P함수(recntmutex에 접근을 가능하게) 해준다
-  /* rdcntmutex로 특정 readcnt에 접근하고 +1해줌. 원래 0으로 세팅되어있어서, 누가 안쓰고 있으면 0이었다가 1로 되고 if문 들어감 */
-  P(&cache.cacheobjs[i].rdcntmutex); // P연산(locking):정상인지 검사, 기다림 (P함수 비정상이면 에러 도출되는 로직임)
-  cache.cacheobjs[i].readCnt++; // readCnt 풀고 들어감
-  /* 조건문 들어오면 그때서야 캐쉬에 접근 가능. 그래서 만약 누가 쓰고있어도 P, readCnt까지는 할 수 있는데 +1이 되니까 1->2가 되고 
-    그러면 캐시에 접근을 못하게 됨. but readerAfter에서 -1 다시 내려주기때문에 0, 1, 0 에서만 움직임 */
-  if (cache.cacheobjs[i].readCnt == 1)
-    P(&cache.cacheobjs[i].wmutex); // write mutex 뮤텍스를 풀고(캐시에 접근)
-  V(&cache.cacheobjs[i].rdcntmutex); // V연산 풀기(캐시 쫒아냄) / read count mutex
-}
-
-void readerAfter(int i) {
-  P(&cache.cacheobjs[i].rdcntmutex);
-  cache.cacheobjs[i].readCnt--;
-  if (cache.cacheobjs[i].readCnt == 0)
-    V(&cache.cacheobjs[i].wmutex);
-  V(&cache.cacheobjs[i].rdcntmutex);
-}
-
-// int cache_find(char *url) {
-//   int i;
-//   for (i=0; i<CACHE_OBJS_COUNT; i++) {
-//     readerPre(i); /* if문 중간에 멈출 필요 없음 */
-//     if ((cache.cacheobjs[i].isEmpty == 0) && (strcmp(url, cache.cacheobjs[i].cache_url) == 0))
-//       break;
-//     readerAfter(i);
-//   }
-//   if (i >= CACHE_OBJS_COUNT)
-//     return -1;
-//   return i;
-// }
-
-/* feedback : if문 중간에 멈출 필요 없음 */
-int cache_find(char *url) {
-  int i;
-  for (i = 0; i < CACHE_OBJS_COUNT; i++) {
-    readerPre(i);
-    if (cache.cacheobjs[i].isEmpty == 0 && strcmp(url, cache.cacheobjs[i].cache_url) == 0) {
-      readerAfter(i);
-      return i;
-    }
-    readerAfter(i);
-  }
-  return -1;
-}
-
-int cache_eviction() { // 캐시 쫒아내기
-  int min = LRU_MAGIC_NUMBER;
-  int minindex = 0;
-  int i;
-  for (i=0; i<CACHE_OBJS_COUNT; i++) {
-    readerPre(i);
-    if (cache.cacheobjs[i].isEmpty == 1) {
-      minindex = i;
-      readerAfter(i);
-      break;
-    }
-    if (cache.cacheobjs[i].LRU < min) {
-      minindex = i;
-      min = cache.cacheobjs[i]. LRU;
-      readerAfter(i);
-      continue;
-    }
-    readerAfter(i);
-  }
-  return minindex;
-}
-
-void writePre(int i) {
-  P(&cache.cacheobjs[i].wmutex);
-}
-
-void writeAfter(int i) {
-  V(&cache.cacheobjs[i].wmutex);
-}
-
-// update the LRU number except the new cache one
-// void cache_LRU(int index) {
-//   int i;
-//   for (i=0; i<index; i++) { // ex) 5 일때 5 이하 다 내려줌  /* feedback : index 반으로 나눌 필요 없음 */
-//     writePre(i);
-//     if (cache.cacheobjs[i].isEmpty == 0 && i != index)
-//       cache.cacheobjs[i].LRU--;
-//     writeAfter(i);
-//   }
-//   i++;
-//   for (i; i<CACHE_OBJS_COUNT; i++) { // 5부터 10 사이 수도 내려줌
-//     writePre(i);
-//     if (cache.cacheobjs[i].isEmpty == 0 && i != index) {
-//       cache.cacheobjs[i].LRU--; // 이미 찾은 애는 9999로 보냈으니 그 앞에있는 애들 인덱스 -1씩 내려준다
-//     }
-//     writeAfter(i);
-//   }
-// }
-
-/* feedback : index 반으로 나눌 필요 없음 */
-void cache_LRU(int index) {
-  int i;
-  for (i = 0; i < CACHE_OBJS_COUNT; i++) {
-    if (i == index) { continue; }
-    writePre(i);
-    if (cache.cacheobjs[i].isEmpty == 0) {
-      cache.cacheobjs[i].LRU--;
-    }
-    writeAfter(i);
-  }
-}
-
-// cache the uri and content in cache
-void cache_uri(char *uri, char *buf) {
-  int i = cache_eviction(); // 빈 캐시 블럭을 찾는 첫번째 index
-  
-  writePre(i);
-
-  strcpy(cache.cacheobjs[i].cache_obj, buf);
-  strcpy(cache.cacheobjs[i].cache_url, uri);
-  cache.cacheobjs[i].isEmpty = 0;
-  cache.cacheobjs[i].LRU = LRU_MAGIC_NUMBER; // 가장 최근에 했으니 우선순위 9999로 보내줌
-  cache_LRU(i); // 나 빼고 LRU 다 내려.. 난 9999니까
-
-  writeAfter(i);
-}
@@ -0,0 +1,682 @@
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "csapp.h"
+#include "cache.h"
+#include "dnscache.h"
+#include "cachekey.h"
+
+// Proxy part.4 - Event loop
+/* connection마다 쓰레드를 만들지 않고, 코어마다 epoll 루프 하나가
+   자기가 accept한 connection 전부를 non-blocking 상태 머신으로 처리한다 */
+
+#define MAX_EVENTS 256
+#define MAX_REQ_SIZE (4 * MAXLINE) /* request line + header 최대 크기 */
+#define REQ_BUF_INIT 1024          /* 처음 요청을 받을 때 잡는 버퍼 크기 */
+#define BODY_TO_EOF (-1L)          /* end server가 닫을 때까지가 body */
+#define BODY_CHUNKED (-2L)
+
+static const char *user_agent_hdr =
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 "
+    "Firefox/10.0.3\r\n";
+static const char *requestline_hdr_format = "GET %s HTTP/1.0\r\n";
+static const char *eof = "\r\n";
+static const char *host_hdr_format = "Host: %s\r\n";
+static const char *conn_hdr = "Connection: close\r\n";
+static const char *prox_hdr = "Proxy-Connection: close\r\n";
+
+static const char *host_key = "Host";
+static const char *connection_key = "Connection";
+static const char *proxy_connection_key = "Proxy-Connection";
+static const char *user_agent_key = "User-Agent";
+
+typedef enum {
+  READ_REQUEST, /* client의 request line과 header를 빈 줄까지 모으는 중 */
+  CONNECTING,   /* end server로 non-blocking connect 진행 중 */
+  SEND_REQUEST, /* req_msg를 end server로 보내는 중 */
+  RELAY,        /* end server의 응답을 client로 넘겨주는 중 */
+  RESPOND       /* proxy가 직접 만든 응답(cache hit, error)을 보내는 중 */
+} conn_state;
+
+struct conn;
+
+/* epoll에 등록되는 단위. 어느 connection의 어느 쪽 fd인지 알려준다 */
+typedef struct {
+  int fd;
+  struct conn *conn;
+} endpoint;
+
+typedef struct conn {
+  endpoint client, server;
+  conn_state state;
+  int epfd;                   /* 이 connection을 맡은 루프의 epoll fd */
+
+  char *buf;                  /* READ_REQUEST: 받은 요청, 그 뒤: client로 보낼 bytes */
+  size_t len, off, cap;
+  int client_blocked;         /* client가 못 받아서 server 읽기를 멈춘 상태 */
+
+  char *req_msg;              /* end server로 보낼 요청 */
+  size_t req_len, req_off;
+  struct addrinfo *addrs, *next_addr;
+
+  cachekey_t *key;            /* cache key, uri를 정규화한 것 */
+  char *cachebuf;             /* 응답을 모아뒀다가 끝나면 cache에 넣는다 */
+  size_t cachelen, cachecap;
+  int cacheable;
+  size_t hdrlen;              /* 응답 header 길이, 빈 줄까지 아직 안 왔으면 0 */
+  long body_len;              /* header에서 읽은 body 길이, BODY_TO_EOF, BODY_CHUNKED */
+  struct timespec fetch_start; /* 이름 풀이부터 응답 끝까지가 cache에 알려 줄 비용 */
+
+  int closed;
+  struct conn *next_dead;     /* 이번 epoll_wait 묶음 처리 후 free할 목록 */
+} conn_t;
+
+void *event_thread(void *vargp);
+void event_loop(int listenfd);
+void accept_conns(int epfd, int listenfd);
+int handle_event(endpoint *ep, uint32_t events);
+int read_request(conn_t *c);
+int process_request(conn_t *c);
+int try_connect(conn_t *c);
+int finish_connect(conn_t *c);
+int send_request(conn_t *c);
+int relay_read(conn_t *c);
+long body_framing(const char *hdrs, size_t len);
+int body_complete(conn_t *c);
+int flush_client(conn_t *c);
+void conn_close(conn_t *c, conn_t **dead);
+void conn_free(conn_t *c);
+int set_events(conn_t *c, endpoint *ep, uint32_t events);
+void queue_error(conn_t *c, char *cause, char *errnum, char *shortmsg, char *longmsg);
+
+void parse_uri(char *uri, char *hostname, char *path, int *port);
+unsigned long since_us(struct timespec *start);
+void build_req_msg(char *req_msg, char *hostname, char *path, char *hdrs);
+void raise_nofile_limit();
+
+int main(int argc, char **argv) {
+  int listenfd, nloops, reuseport = 0, compress = 0, hugepages = 0, sort = 0, opt, i;
+  char *strip = NULL;
+  const cache_policy *policy = &policy_lru;
+  pthread_t tid;
+
+  nloops = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt(argc, argv, "l:re:zHQ:O")) != -1) {
+    switch (opt) {
+    case 'l': nloops = atoi(optarg); break;
+    case 'r': reuseport = 1; break;
+    case 'e': policy = policy_find(optarg); break;
+    case 'z': compress = 1; break;
+    case 'H': hugepages = 1; break;
+    case 'Q': strip = optarg; break;
+    case 'O': sort = 1; break;
+    default: optind = argc + 1; break;
+    }
+  }
+  if (optind != argc - 1 || nloops < 1 || policy == NULL) {
+    fprintf(stderr, "usage: %s [-l loops] [-r] [-e %s] [-z] [-H] [-Q strip params] [-O] <port>\n", argv[0], policy_names());
+    exit(1);
+  }
+
+  Signal(SIGPIPE, SIG_IGN);
+  raise_nofile_limit(); /* connection 하나에 fd가 최대 두 개 필요하다 */
+  slab_init(MAX_CACHE_SIZE, hugepages);
+  cachekey_init(strip, sort);
+  cache_init(MAX_CACHE_SIZE, CACHE_SHARDS, policy, FRESH_DEFAULT_TTL, compress); /* 루프마다 쓰레드라서 proxy_cache처럼 나눈다 */
+  dnscache_init(DNS_TTL, DNS_NEG_TTL);
+
+  /* 기본은 루프마다 같은 listenfd를 EPOLLEXCLUSIVE로 등록해서 하나만 깨어나게 한다.
+     -r이면 루프마다 SO_REUSEPORT 듣기 소켓을 따로 열어서 kernel이 나눠주게 한다 */
+  if (!reuseport)
+    listenfd = Open_listenfd(argv[optind]);
+  for (i = 0; i < nloops; i++) {
+    if (reuseport)
+      listenfd = Open_listenfd_reuseport(argv[optind]);
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    if (i < nloops - 1)
+      Pthread_create(&tid, NULL, event_thread, (void *)(long)listenfd);
+  }
+  event_loop(listenfd);
+  return 0;
+}
+
+void *event_thread(void *vargp) {
+  Pthread_detach(pthread_self());
+  event_loop((int)(long)vargp);
+  return NULL;
+}
+
+void event_loop(int listenfd) {
+  struct epoll_event ev, events[MAX_EVENTS];
+  conn_t *dead;
+  int epfd, n, i;
+
+  if ((epfd = epoll_create1(0)) < 0)
+    unix_error("epoll_create1 error");
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = NULL; /* NULL이면 listenfd */
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+    unix_error("epoll_ctl error");
+
+  while (1) {
+    if ((n = epoll_wait(epfd, events, MAX_EVENTS, -1)) < 0) {
+      if (errno == EINTR)
+        continue;
+      unix_error("epoll_wait error");
+    }
+
+    /* 같은 묶음 안에 client, server 이벤트가 같이 올 수 있어서 free는 묶음이 끝난 뒤에 한다 */
+    dead = NULL;
+    for (i = 0; i < n; i++) {
+      endpoint *ep = events[i].data.ptr;
+      if (ep == NULL) {
+        accept_conns(epfd, listenfd);
+        continue;
+      }
+      if (ep->conn->closed)
+        continue;
+      if (handle_event(ep, events[i].events) < 0)
+        conn_close(ep->conn, &dead);
+    }
+    while (dead) {
+      conn_t *next = dead->next_dead;
+      conn_free(dead);
+      dead = next;
+    }
+  }
+}
+
+void accept_conns(int epfd, int listenfd) {
+  struct epoll_event ev;
+  int connfd;
+  conn_t *c;
+
+  while ((connfd = accept(listenfd, NULL, NULL)) >= 0) {
+    fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+    c = Calloc(1, sizeof(conn_t));
+    c->client.fd = connfd;
+    c->client.conn = c;
+    c->server.fd = -1;
+    c->server.conn = c;
+    c->epfd = epfd;
+    c->state = READ_REQUEST;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &c->client;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+      close(connfd);
+      Free(c);
+    }
+  }
+}
+
+/* 상태에 맞는 처리를 한다. -1을 반환하면 connection을 닫는다 */
+int handle_event(endpoint *ep, uint32_t events) {
+  conn_t *c = ep->conn;
+
+  if (ep == &c->client && (events & (EPOLLERR | EPOLLHUP)))
+    return -1;
+
+  switch (c->state) {
+  case READ_REQUEST:
+    return read_request(c);
+  case CONNECTING:
+    return ep == &c->server ? finish_connect(c) : 0;
+  case SEND_REQUEST:
+    return ep == &c->server ? send_request(c) : 0;
+  case RELAY:
+    if (ep == &c->client)
+      return flush_client(c);
+    if (events & EPOLLERR)
+      return -1;
+    return c->client_blocked ? 0 : relay_read(c);
+  case RESPOND:
+    return flush_client(c);
+  }
+  return -1;
+}
+
+int read_request(conn_t *c) {
+  ssize_t n;
+  size_t scan;
+
+  while (1) {
+    if (c->len == c->cap) {
+      if (c->cap >= MAX_REQ_SIZE)
+        return -1;
+      c->cap = c->cap ? c->cap * 2 : REQ_BUF_INIT;
+      c->buf = Realloc(c->buf, c->cap + 1);
+    }
+    if ((n = read(c->client.fd, c->buf + c->len, c->cap - c->len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return -1;
+    }
+    if (n == 0)
+      return -1;
+
+    /* 새로 들어온 부분 바로 앞 3바이트부터 빈 줄을 찾는다 */
+    scan = c->len > 3 ? c->len - 3 : 0;
+    c->len += n;
+    c->buf[c->len] = '\0';
+    if (strstr(c->buf + scan, "\r\n\r\n"))
+      return process_request(c);
+  }
+}
+
+int process_request(conn_t *c) {
+  char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+  char hostname[MAXLINE], path[MAXLINE];
+  char req_msg[MAX_REQ_SIZE];
+  char port_str[16];
+  int port, rc;
+  cache_obj *obj;
+  char *body, *raw;
+  size_t bodylen;
+  int fresh;
+  char *hdrs;
+
+  /* 요청을 다 받았으니 client 쪽은 더 읽지 않는다 */
+  if (set_events(c, &c->client, 0) < 0)
+    return -1;
+
+  if (sscanf(c->buf, "%8191s %8191s %8191s", method, uri, version) != 3) {
+    queue_error(c, c->buf, "400", "Bad request", "Proxy could not parse the request");
+    return flush_client(c);
+  }
+  if (strcasecmp(method, "GET")) {
+    queue_error(c, method, "501", "Not implemented", "Proxy does not implement this method");
+    return flush_client(c);
+  }
+  c->key = cachekey_make(uri);
+  uri[strcspn(uri, "#")] = '\0'; /* fragment는 end server에 보내지 않는다 */
+
+  // in cache then return the cache content
+  /* stale한 객체는 revalidate 하지 않고 miss처럼 다시 받는다. 받은 응답이 그 자리를 바꿔 끼운다 */
+  if ((obj = cache_lookup(c->key->s, &fresh)) != NULL && !fresh) {
+    cache_release(obj);
+    obj = NULL;
+  }
+  /* 압축해 둔 객체는 풀어서 원래 header로 보낸다. 못 풀면 miss로 다시 받는다 */
+  if (obj != NULL && (body = cache_body(obj, 0, &bodylen, &raw)) == NULL) {
+    cache_release(obj);
+    obj = NULL;
+  }
+  if (obj != NULL) {
+    c->len = obj->hdrlen + bodylen;
+    c->off = 0;
+    if (c->len > c->cap) {
+      c->cap = c->len;
+      c->buf = Realloc(c->buf, c->cap + 1);
+    }
+    memcpy(c->buf, obj->hdrs, obj->hdrlen);
+    if (bodylen > 0)
+      memcpy(c->buf + obj->hdrlen, body, bodylen);
+    if (raw)
+      Free(raw);
+    cache_release(obj);
+    c->state = RESPOND;
+    return flush_client(c);
+  }
+
+  parse_uri(uri, hostname, path, &port);
+  hdrs = strstr(c->buf, "\r\n") + 2;
+  build_req_msg(req_msg, hostname, path, hdrs);
+  c->req_len = strlen(req_msg);
+  c->req_off = 0;
+  c->req_msg = Malloc(c->req_len);
+  memcpy(c->req_msg, req_msg, c->req_len);
+
+  /* 이름 풀이는 blocking이지만 cache에 있으면 바로 끝난다. connect는 루프에 맡긴다 */
+  clock_gettime(CLOCK_MONOTONIC, &c->fetch_start);
+  sprintf(port_str, "%d", port);
+  if ((rc = dns_getaddrinfo(hostname, port_str, &c->addrs)) != 0) {
+    c->addrs = NULL;
+    queue_error(c, hostname, "502", "Bad gateway", "Proxy could not resolve the end server");
+    return flush_client(c);
+  }
+  c->next_addr = c->addrs;
+  c->cacheable = 1;
+  return try_connect(c);
+}
+
+/* next_addr부터 차례대로 non-blocking connect를 건다 */
+int try_connect(conn_t *c) {
+  struct epoll_event ev;
+  struct addrinfo *p;
+  int fd;
+
+  for (p = c->next_addr; p; p = p->ai_next) {
+    if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0)
+      continue;
+    if (connect(fd, p->ai_addr, p->ai_addrlen) < 0 && errno != EINPROGRESS) {
+      close(fd);
+      continue;
+    }
+    c->server.fd = fd;
+    c->next_addr = p->ai_next;
+    c->state = CONNECTING;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = &c->server;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+      return -1;
+    return 0;
+  }
+
+  c->state = RESPOND;
+  queue_error(c, "end server", "502", "Bad gateway", "Proxy could not connect to the end server");
+  return flush_client(c);
+}
+
+int finish_connect(conn_t *c) {
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+
+  if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err != 0) {
+    close(c->server.fd); /* close하면 epoll에서도 빠진다 */
+    c->server.fd = -1;
+    return try_connect(c);
+  }
+  dns_freeaddrinfo(c->addrs);
+  c->addrs = c->next_addr = NULL;
+  c->state = SEND_REQUEST;
+  return send_request(c);
+}
+
+int send_request(conn_t *c) {
+  ssize_t n;
+
+  while (c->req_off < c->req_len) {
+    if ((n = write(c->server.fd, c->req_msg + c->req_off, c->req_len - c->req_off)) < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return -1;
+    }
+    c->req_off += n;
+  }
+  Free(c->req_msg);
+  c->req_msg = NULL;
+
+  /* 요청 버퍼를 응답 relay용으로 다시 쓴다 */
+  c->len = c->off = 0;
+  if (c->cap < MAXBUF) {
+    c->cap = MAXBUF;
+    c->buf = Realloc(c->buf, c->cap + 1);
+  }
+  c->state = RELAY;
+  return set_events(c, &c->server, EPOLLIN);
+}
+
+/* client로 보낼 버퍼가 비었을 때만 end server에서 읽는다 */
+int relay_read(conn_t *c) {
+  ssize_t n;
+
+  while ((n = read(c->server.fd, c->buf, c->cap)) < 0) {
+    if (errno == EINTR)
+      continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    return -1;
+  }
+
+  if (n == 0) {
+    /* 응답이 끝났다. body가 header에 적힌 만큼 다 왔을 때만 header와 body를 나눠서 길이대로 넣는다.
+       end server가 중간에 끊은 응답은 잘린 채로 cache에 남지 않게 버린다 */
+    if (c->cacheable && c->hdrlen > 0 && body_complete(c))
+      cache_uri(c->key->s, c->cachebuf, c->hdrlen, c->cachebuf + c->hdrlen, c->cachelen - c->hdrlen,
+                since_us(&c->fetch_start));
+    return -1;
+  }
+
+  if (c->cacheable) {
+    if (c->cachelen + n >= MAX_OBJECT_SIZE) {
+      c->cacheable = 0;
+      Free(c->cachebuf);
+      c->cachebuf = NULL;
+    } else {
+      if (c->cachelen + n >= c->cachecap) {
+        while (c->cachelen + n >= c->cachecap)
+          c->cachecap = c->cachecap ? c->cachecap * 2 : MAXBUF;
+        c->cachebuf = Realloc(c->cachebuf, c->cachecap);
+      }
+      memcpy(c->cachebuf + c->cachelen, c->buf, n);
+      c->cachelen += n;
+      /* header가 다 오면 body가 어디서 끝나는지 적어둔다 */
+      if (c->hdrlen == 0 && (c->hdrlen = cache_hdrlen(c->cachebuf, c->cachelen)) > 0)
+        c->body_len = body_framing(c->cachebuf, c->hdrlen);
+    }
+  }
+
+  c->len = n;
+  c->off = 0;
+  return flush_client(c);
+}
+
+int flush_client(conn_t *c) {
+  ssize_t n;
+
+  while (c->off < c->len) {
+    if ((n = write(c->client.fd, c->buf + c->off, c->len - c->off)) < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        /* client가 느리면 server 읽기를 멈추고 client가 쓸 수 있게 될 때까지 기다린다 */
+        if (!c->client_blocked) {
+          c->client_blocked = 1;
+          if (set_events(c, &c->client, EPOLLOUT) < 0)
+            return -1;
+          if (c->state == RELAY && set_events(c, &c->server, 0) < 0)
+            return -1;
+        }
+        return 0;
+      }
+      return -1;
+    }
+    c->off += n;
+  }
+  c->len = c->off = 0;
+
+  if (c->state == RESPOND)
+    return -1; /* 다 보냈으면 끝 */
+
+  if (c->client_blocked) {
+    c->client_blocked = 0;
+    if (set_events(c, &c->client, 0) < 0 || set_events(c, &c->server, EPOLLIN) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int set_events(conn_t *c, endpoint *ep, uint32_t events) {
+  struct epoll_event ev;
+
+  ev.events = events;
+  ev.data.ptr = ep;
+  return epoll_ctl(c->epfd, EPOLL_CTL_MOD, ep->fd, &ev);
+}
+
+/* fd는 바로 닫아서 epoll에서 빼고, 메모리는 묶음이 끝난 뒤에 free한다 */
+void conn_close(conn_t *c, conn_t **dead) {
+  if (c->server.fd >= 0)
+    close(c->server.fd);
+  close(c->client.fd);
+  c->closed = 1;
+  c->next_dead = *dead;
+  *dead = c;
+}
+
+void conn_free(conn_t *c) {
+  if (c->addrs)
+    dns_freeaddrinfo(c->addrs);
+  free(c->buf);
+  free(c->req_msg);
+  free(c->key);
+  free(c->cachebuf);
+  Free(c);
+}
+
+/* clienterror와 같은 응답을 만들어서 client 버퍼에 넣는다 */
+void queue_error(conn_t *c, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+  char body[MAXLINE];
+  int bodylen;
+
+  bodylen = snprintf(body, MAXLINE,
+                     "<html><title>Proxy Error</title><body bgcolor=ffffff>\r\n"
+                     "%s : %s\r\n<p>%s: %.512s\r\n",
+                     errnum, shortmsg, longmsg, cause);
+  if (c->cap < MAXLINE + bodylen) {
+    c->cap = MAXLINE + bodylen;
+    c->buf = Realloc(c->buf, c->cap + 1);
+  }
+  c->len = sprintf(c->buf,
+                   "HTTP/1.0 %s %s\r\nContent-type: text/html\r\nContent-length: %d\r\n\r\n%s",
+                   errnum, shortmsg, bodylen, body);
+  c->off = 0;
+  c->state = RESPOND;
+}
+
+/* hdrs: request line 다음부터 빈 줄까지의 header들 */
+void build_req_msg(char *req_msg, char *hostname, char *path, char *hdrs) {
+  char request_hdr[MAXLINE], other_hdr[MAXLINE], host_hdr[MAXLINE];
+  char *line, *end;
+  size_t linelen, otherlen = 0;
+
+  sprintf(request_hdr, requestline_hdr_format, path);
+  host_hdr[0] = '\0';
+  other_hdr[0] = '\0';
+
+  for (line = hdrs; (end = strstr(line, "\r\n")) != NULL && end != line; line = end + 2) {
+    linelen = end + 2 - line;
+    if (linelen >= MAXLINE)
+      continue;
+
+    if (!strncasecmp(line, host_key, strlen(host_key))) {
+      memcpy(host_hdr, line, linelen);
+      host_hdr[linelen] = '\0';
+      continue;
+    }
+
+    /* connection, proxy_connection, user_agent는 고정값으로 넣는다 */
+    if (strncasecmp(line, connection_key, strlen(connection_key))
+        && strncasecmp(line, proxy_connection_key, strlen(proxy_connection_key))
+        && strncasecmp(line, user_agent_key, strlen(user_agent_key))
+        && otherlen + linelen < MAXLINE / 2) {
+      memcpy(other_hdr + otherlen, line, linelen);
+      otherlen += linelen;
+      other_hdr[otherlen] = '\0';
+    }
+  }
+
+  if (strlen(host_hdr) == 0)
+    sprintf(host_hdr, host_hdr_format, hostname);
+
+  snprintf(req_msg, MAX_REQ_SIZE, "%s%s%s%s%s%s%s",
+           request_hdr,
+           host_hdr,
+           conn_hdr,
+           prox_hdr,
+           user_agent_hdr,
+           other_hdr,
+           eof);
+}
+
+/* 응답 header로 body 길이를 정한다. body가 없는 status면 0, chunked면 BODY_CHUNKED,
+   Content-length가 있으면 그 값, 아니면 end server가 닫을 때까지(BODY_TO_EOF) */
+long body_framing(const char *hdrs, size_t len) {
+  const char *v, *sp, *eol;
+  char num[32];
+  size_t vlen;
+  long n;
+  int status = 0;
+
+  /* header는 빈 줄로 끝나니까 숫자 뒤에 숫자가 아닌 byte가 반드시 있다 */
+  if ((eol = memchr(hdrs, '\n', len)) != NULL && (sp = memchr(hdrs, ' ', eol - hdrs)) != NULL)
+    status = atoi(sp + 1);
+  if ((status >= 100 && status < 200) || status == 204 || status == 304)
+    return 0;
+  if ((v = http_header_value(hdrs, len, "Transfer-Encoding", &vlen)) != NULL
+      && vlen >= 7 && !strncasecmp(v + vlen - 7, "chunked", 7))
+    return BODY_CHUNKED;
+  if ((v = http_header_value(hdrs, len, "Content-length", &vlen)) != NULL && vlen < sizeof(num)) {
+    memcpy(num, v, vlen);
+    num[vlen] = '\0';
+    if ((n = strtol(num, NULL, 10)) >= 0)
+      return n;
+  }
+  return BODY_TO_EOF;
+}
+
+/* end server가 닫았을 때 모아둔 body가 온전한지. 길이를 알면 딱 그만큼, chunked면 마지막 0 chunk와
+   trailer 끝 빈 줄까지 왔어야 한다. 닫을 때까지가 body인 응답은 닫힌 것이 끝이다 */
+int body_complete(conn_t *c) {
+  const char *p = c->cachebuf + c->hdrlen, *end = c->cachebuf + c->cachelen, *eol;
+  unsigned long size;
+
+  if (c->body_len == BODY_TO_EOF)
+    return 1;
+  if (c->body_len >= 0)
+    return c->cachelen - c->hdrlen == (size_t)c->body_len;
+
+  /* chunk 크기 줄을 따라가며 건너뛴다. 크기 줄은 '\n'으로 끝나서 strtoul이 밖을 읽지 않는다 */
+  while ((eol = memchr(p, '\n', end - p)) != NULL) {
+    if (!isxdigit((unsigned char)*p))
+      return 0;
+    size = strtoul(p, NULL, 16);
+    p = eol + 1;
+    if (size == 0) {
+      for (; (eol = memchr(p, '\n', end - p)) != NULL; p = eol + 1)
+        if (eol == p || (eol == p + 1 && *p == '\r'))
+          return 1;
+      return 0;
+    }
+    if (size > (unsigned long)(end - p) || (unsigned long)(end - p) - size < 2)
+      return 0;
+    p += size + 2; /* chunk 데이터와 그 뒤 CRLF */
+  }
+  return 0;
+}
+
+/* start부터 지금까지 걸린 시간 */
+unsigned long since_us(struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000UL + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// parse the uri to get hostname, file path (with query), port
+void parse_uri(char *uri, char *hostname, char *path, int *port) {
+  char *host_start, *path_start, *port_start;
+
+  *port = 80;
+  host_start = strstr(uri, "//");
+  host_start = host_start != NULL ? host_start + 2 : uri;
+
+  path_start = strchr(host_start, '/');
+  if (path_start != NULL) {
+    sscanf(path_start, "%s", path);
+    *path_start = '\0';
+  } else {
+    strcpy(path, "/");
+  }
+
+  port_start = strchr(host_start, ':');
+  if (port_start != NULL) {
+    *port_start = '\0';
+    sscanf(port_start + 1, "%d", port);
+  }
+  sscanf(host_start, "%s", hostname);
+}
+
+void raise_nofile_limit() {
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
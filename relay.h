@@ -0,0 +1,20 @@
+/*
+ * relay.h - zero-copy descriptor-to-descriptor relay
+ */
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include <sys/types.h>
+
+#define RELAY_TO_EOF ((size_t)-1) /* splice_relay: copy until EOF */
+
+/* Snapshot of the counters returned by relay_stats */
+typedef struct {
+    unsigned long relays;     /* splice_relay calls */
+    unsigned long bytes;      /* Bytes they moved */
+} relay_stats_t;
+
+ssize_t splice_relay(int fromfd, int tofd, size_t len);
+void relay_stats(relay_stats_t *st);
+
+#endif /* __RELAY_H__ */
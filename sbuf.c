@@ -0,0 +1,113 @@
+/*
+ * sbuf.c - bounded producer/consumer queue of connected descriptors
+ *
+ *     The CS:APP sbuf package, extended with counters for queue depth,
+ *     producer backpressure and the time each descriptor waits before
+ *     a worker picks it up.
+ */
+/* $begin sbufc */
+#include "sbuf.h"
+
+static unsigned long elapsed_us(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000UL
+        + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/* Create an empty, bounded, shared FIFO buffer with n slots */
+/* $begin sbuf_init */
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->stamp = Calloc(n, sizeof(struct timespec));
+    sp->n = n;                       /* Buffer holds max of n items */
+    sp->front = sp->rear = 0;        /* Empty buffer iff front == rear */
+    Sem_init(&sp->mutex, 0, 1);      /* Binary semaphore for locking */
+    Sem_init(&sp->slots, 0, n);      /* Initially, buf has n empty slots */
+    Sem_init(&sp->items, 0, 0);      /* Initially, buf has zero data items */
+    sp->depth = sp->max_depth = 0;
+    sp->inserted = sp->removed = sp->full = 0;
+    sp->blocked_us = sp->wait_us = sp->max_wait_us = 0;
+}
+/* $end sbuf_init */
+
+/* Clean up buffer sp */
+/* $begin sbuf_deinit */
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+    Free(sp->stamp);
+}
+/* $end sbuf_deinit */
+
+/* Insert item onto the rear of shared buffer sp. Blocks while the
+   buffer is full, which pushes back on the caller's accept loop. */
+/* $begin sbuf_insert */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+    struct timespec start, now;
+    unsigned long blocked = 0;
+    int was_full = 0;
+
+    if (sem_trywait(&sp->slots) < 0) {   /* No free slot: backpressure */
+        was_full = 1;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        P(&sp->slots);                   /* Wait for available slot */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        blocked = elapsed_us(&start, &now);
+    }
+    P(&sp->mutex);                       /* Lock the buffer */
+    sp->rear = (sp->rear + 1) % sp->n;
+    sp->buf[sp->rear] = item;            /* Insert the item */
+    clock_gettime(CLOCK_MONOTONIC, &sp->stamp[sp->rear]);
+    sp->inserted++;
+    sp->full += was_full;
+    sp->blocked_us += blocked;
+    if (++sp->depth > sp->max_depth)
+        sp->max_depth = sp->depth;
+    V(&sp->mutex);                       /* Unlock the buffer */
+    V(&sp->items);                       /* Announce available item */
+}
+/* $end sbuf_insert */
+
+/* Remove and return the first item from buffer sp */
+/* $begin sbuf_remove */
+int sbuf_remove(sbuf_t *sp)
+{
+    struct timespec now;
+    unsigned long waited;
+    int item;
+
+    P(&sp->items);                       /* Wait for available item */
+    P(&sp->mutex);                       /* Lock the buffer */
+    sp->front = (sp->front + 1) % sp->n;
+    item = sp->buf[sp->front];           /* Remove the item */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    waited = elapsed_us(&sp->stamp[sp->front], &now);
+    sp->removed++;
+    sp->depth--;
+    sp->wait_us += waited;
+    if (waited > sp->max_wait_us)
+        sp->max_wait_us = waited;
+    V(&sp->mutex);                       /* Unlock the buffer */
+    V(&sp->slots);                       /* Announce available slot */
+    return item;
+}
+/* $end sbuf_remove */
+
+/* Copy a consistent snapshot of the counters into st */
+void sbuf_stats(sbuf_t *sp, sbuf_stats_t *st)
+{
+    P(&sp->mutex);
+    st->n = sp->n;
+    st->depth = sp->depth;
+    st->max_depth = sp->max_depth;
+    st->inserted = sp->inserted;
+    st->removed = sp->removed;
+    st->full = sp->full;
+    st->blocked_us = sp->blocked_us;
+    st->wait_us = sp->wait_us;
+    st->max_wait_us = sp->max_wait_us;
+    V(&sp->mutex);
+}
+/* $end sbufc */
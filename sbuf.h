@@ -0,0 +1,44 @@
+/*
+ * sbuf.h - bounded producer/consumer queue of connected descriptors
+ */
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+/* $begin sbuft */
+typedef struct {
+    int *buf;          /* Buffer array */
+    struct timespec *stamp; /* When each slot was inserted */
+    int n;             /* Maximum number of slots */
+    int front;         /* buf[(front+1)%n] is first item */
+    int rear;          /* buf[rear%n] is last item */
+    sem_t mutex;       /* Protects accesses to buf and the counters below */
+    sem_t slots;       /* Counts available slots */
+    sem_t items;       /* Counts available items */
+
+    /* Counters for sizing the pool, protected by mutex */
+    int depth;                   /* Items currently queued */
+    int max_depth;               /* High-water mark of depth */
+    unsigned long inserted;      /* Items ever inserted */
+    unsigned long removed;       /* Items ever removed */
+    unsigned long full;          /* Inserts that found the queue full */
+    unsigned long blocked_us;    /* Time producers spent waiting for a slot */
+    unsigned long wait_us;       /* Total time items spent queued */
+    unsigned long max_wait_us;   /* Longest time an item spent queued */
+} sbuf_t;
+/* $end sbuft */
+
+/* Snapshot of the counters returned by sbuf_stats */
+typedef struct {
+    int n, depth, max_depth;
+    unsigned long inserted, removed, full, blocked_us, wait_us, max_wait_us;
+} sbuf_stats_t;
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+void sbuf_stats(sbuf_t *sp, sbuf_stats_t *st);
+
+#endif /* __SBUF_H__ */
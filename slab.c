@@ -0,0 +1,277 @@
+/*
+ * slab.c - slab allocator for cached objects
+ *
+ *     The cache allocates each object as one block and frees it when the
+ *     last reader lets go, so with plain malloc a long run of
+ *     variable-size inserts and evictions fragments the heap. Here blocks
+ *     come from one arena mapped at startup and cut into SLAB_PAGE_SIZE
+ *     pages. Sizes are rounded up to a size class (SLAB_MIN_CHUNK
+ *     growing by SLAB_GROWTH up to a whole page), and each page belongs
+ *     to one class and holds equal chunks of its size, so a freed chunk
+ *     is always reusable as-is by the next block of that class.
+ *
+ *     Every class keeps the pages that still have room on a list, and
+ *     each page its own free list, so allocating and freeing are O(1)
+ *     under the class's lock. A page whose last chunk is freed goes back
+ *     to the arena's pool, from which any class can take it: as the mix
+ *     of object sizes shifts, pages move to the classes that need them.
+ *     When the pool is empty, or for a block bigger than a page, the
+ *     allocator falls back to malloc and counts it.
+ *
+ *     The arena can be backed by transparent huge pages, which cuts TLB
+ *     misses when hits copy out of a large cache.
+ */
+#include "slab.h"
+
+#define SLAB_SLACK_PAGES 16     /* Arena pages beyond 1.5 times the budget */
+
+/* One arena page */
+typedef struct slab_page {
+    int cls;                    /* Class it is carved for, -1 while in the pool */
+    int last_cls;               /* Class it was carved for before */
+    int used;                   /* Chunks handed out */
+    int carved;                 /* Chunks ever handed out since it joined the class */
+    void *free;                 /* Freed chunks, linked through their first word */
+    struct slab_page *prev, *next;  /* Class's list of pages with room, or the pool */
+} slab_page_t;
+
+typedef struct {
+    size_t size;
+    int per_page;               /* Chunks per page */
+    int pages;
+    slab_page_t *partial;       /* Pages with at least one chunk free */
+    unsigned long used, allocs, fallbacks;
+    size_t requested;
+    sem_t mutex;                /* Protects the class and its pages */
+} slab_class_t;
+
+static int enabled, hugepages;
+static char *arena;
+static size_t arena_len;
+static slab_page_t *pages;
+static int npages;
+static slab_class_t classes[SLAB_MAX_CLASSES];
+static int nclasses;
+
+static sem_t pool_mutex;        /* Protects the pool and the counters below */
+static slab_page_t *pool;
+static int pool_pages;
+static unsigned long reassigned, large;
+
+static void list_push(slab_page_t **head, slab_page_t *pg)
+{
+    pg->prev = NULL;
+    pg->next = *head;
+    if (*head)
+        (*head)->prev = pg;
+    *head = pg;
+}
+
+static void list_unlink(slab_page_t **head, slab_page_t *pg)
+{
+    if (pg->prev)
+        pg->prev->next = pg->next;
+    else
+        *head = pg->next;
+    if (pg->next)
+        pg->next->prev = pg->prev;
+}
+
+/* Smallest class whose chunks hold n bytes, or -1 */
+static int class_of(size_t n)
+{
+    int lo = 0, hi = nclasses - 1, mid;
+
+    if (n > classes[hi].size)
+        return -1;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (classes[mid].size >= n)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+/*
+ * slab_init - Map an arena for a cache of budget bytes: one and a half
+ *     times the budget, for the slack inside chunks and pages, plus a few
+ *     pages so every class in use can have one. Pages are only touched
+ *     when a class first carves them. With hugepages, the arena is
+ *     aligned to SLAB_HUGE_PAGE and marked for transparent huge pages.
+ */
+void slab_init(size_t budget, int use_huge)
+{
+    size_t size, align = use_huge ? SLAB_HUGE_PAGE : SLAB_PAGE_SIZE;
+    char *map;
+    int i;
+
+    for (size = SLAB_MIN_CHUNK; nclasses < SLAB_MAX_CLASSES - 1 && size < SLAB_PAGE_SIZE; ) {
+        classes[nclasses++].size = size;
+        size = ((size_t)(size * SLAB_GROWTH) + 7) & ~(size_t)7;
+    }
+    classes[nclasses++].size = SLAB_PAGE_SIZE;
+    for (i = 0; i < nclasses; i++) {
+        classes[i].per_page = SLAB_PAGE_SIZE / classes[i].size;
+        Sem_init(&classes[i].mutex, 0, 1);
+    }
+
+    arena_len = budget + budget / 2 + (size_t)SLAB_SLACK_PAGES * SLAB_PAGE_SIZE;
+    arena_len = (arena_len + align - 1) / align * align;
+    /* Map one alignment unit more and trim, so the arena starts on a boundary */
+    map = Mmap(NULL, arena_len + align, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    arena = (char *)(((unsigned long)map + align - 1) & ~(unsigned long)(align - 1));
+    if (arena > map)
+        Munmap(map, arena - map);
+    if (map + align > arena)
+        Munmap(arena + arena_len, map + align - arena);
+#ifdef MADV_HUGEPAGE
+    if (use_huge && madvise(arena, arena_len, MADV_HUGEPAGE) == 0)
+        hugepages = 1;
+#endif
+
+    npages = arena_len / SLAB_PAGE_SIZE;
+    pages = Calloc(npages, sizeof(slab_page_t));
+    Sem_init(&pool_mutex, 0, 1);
+    for (i = npages - 1; i >= 0; i--) {
+        pages[i].cls = pages[i].last_cls = -1;
+        list_push(&pool, &pages[i]);
+    }
+    pool_pages = npages;
+    enabled = 1;
+}
+
+/* Take a page from the pool for class c, or NULL. Caller holds c's mutex */
+static slab_page_t *page_get(int c)
+{
+    slab_page_t *pg;
+
+    P(&pool_mutex);
+    if ((pg = pool) != NULL) {
+        list_unlink(&pool, pg);
+        pool_pages--;
+        if (pg->last_cls != -1 && pg->last_cls != c)
+            reassigned++;
+    }
+    V(&pool_mutex);
+    if (pg == NULL)
+        return NULL;
+    pg->cls = pg->last_cls = c;
+    pg->used = pg->carved = 0;
+    pg->free = NULL;
+    classes[c].pages++;
+    return pg;
+}
+
+/* Give an empty page of class c back to the pool. Caller holds c's mutex */
+static void page_put(int c, slab_page_t *pg)
+{
+    list_unlink(&classes[c].partial, pg);
+    classes[c].pages--;
+    pg->cls = -1;
+    P(&pool_mutex);
+    list_push(&pool, pg);
+    pool_pages++;
+    V(&pool_mutex);
+}
+
+/*
+ * slab_alloc - A block of at least n bytes, from the arena if it has
+ *     room. Free it with slab_free, giving the same n.
+ */
+void *slab_alloc(size_t n)
+{
+    slab_class_t *cl;
+    slab_page_t *pg;
+    char *p;
+    int c;
+
+    if (!enabled)
+        return Malloc(n);
+    if ((c = class_of(n)) < 0) {
+        P(&pool_mutex);
+        large++;
+        V(&pool_mutex);
+        return Malloc(n);
+    }
+    cl = &classes[c];
+    P(&cl->mutex);
+    cl->allocs++;
+    if ((pg = cl->partial) == NULL) {
+        if ((pg = page_get(c)) == NULL) {
+            cl->fallbacks++;
+            V(&cl->mutex);
+            return Malloc(n);
+        }
+        list_push(&cl->partial, pg);
+    }
+    if ((p = pg->free) != NULL)
+        pg->free = *(void **)p;
+    else
+        p = arena + (pg - pages) * (size_t)SLAB_PAGE_SIZE + (size_t)pg->carved++ * cl->size;
+    if (++pg->used == cl->per_page)
+        list_unlink(&cl->partial, pg);
+    cl->used++;
+    cl->requested += n;
+    V(&cl->mutex);
+    return p;
+}
+
+void slab_free(void *vp, size_t n)
+{
+    char *p = vp;
+    slab_page_t *pg;
+    slab_class_t *cl;
+
+    if (p == NULL)
+        return;
+    if (!enabled || p < arena || p >= arena + arena_len) {
+        Free(p);                /* Fell back to malloc */
+        return;
+    }
+    /* The page cannot change class while p is in use, so reading cls unlocked is safe */
+    pg = &pages[(p - arena) / SLAB_PAGE_SIZE];
+    cl = &classes[pg->cls];
+    P(&cl->mutex);
+    *(void **)p = pg->free;
+    pg->free = p;
+    if (pg->used-- == cl->per_page)
+        list_push(&cl->partial, pg);
+    cl->used--;
+    cl->requested -= n;
+    if (pg->used == 0)
+        page_put(pg->cls, pg);
+    V(&cl->mutex);
+}
+
+void slab_stats(slab_stats_t *st)
+{
+    slab_class_t *cl;
+    int i;
+
+    memset(st, 0, sizeof(*st));
+    if (!enabled)
+        return;
+    st->enabled = 1;
+    st->hugepages = hugepages;
+    st->nclasses = nclasses;
+    st->pages = npages;
+    for (i = 0; i < nclasses; i++) {
+        cl = &classes[i];
+        P(&cl->mutex);
+        st->cls[i].size = cl->size;
+        st->cls[i].pages = cl->pages;
+        st->cls[i].used = cl->used;
+        st->cls[i].total = (unsigned long)cl->pages * cl->per_page;
+        st->cls[i].requested = cl->requested;
+        st->cls[i].allocs = cl->allocs;
+        st->cls[i].fallbacks = cl->fallbacks;
+        V(&cl->mutex);
+    }
+    P(&pool_mutex);
+    st->free_pages = pool_pages;
+    st->reassigned = reassigned;
+    st->large = large;
+    V(&pool_mutex);
+}
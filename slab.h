@@ -0,0 +1,40 @@
+/*
+ * slab.h - slab allocator for cached objects
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "csapp.h"
+
+#define SLAB_PAGE_SIZE (128 << 10)    /* Arena page; also the largest chunk */
+#define SLAB_MIN_CHUNK 64
+#define SLAB_GROWTH 1.25              /* Each class's chunk is this much bigger */
+#define SLAB_MAX_CLASSES 48
+#define SLAB_HUGE_PAGE (2 << 20)      /* Arena alignment when huge pages are asked for */
+
+/* One size class in slab_stats */
+typedef struct {
+    size_t size;              /* Chunk size */
+    int pages;                /* Arena pages carved into this class */
+    unsigned long used;       /* Chunks handed out */
+    unsigned long total;      /* Chunks the pages hold */
+    size_t requested;         /* Bytes asked for by the chunks in use */
+    unsigned long allocs;
+    unsigned long fallbacks;  /* Allocations that found no page and went to malloc */
+} slab_class_stats_t;
+
+typedef struct {
+    int enabled, hugepages;
+    int nclasses;
+    int pages, free_pages;    /* Arena pages in all, and not owned by a class */
+    unsigned long reassigned; /* Pages that moved to a different class */
+    unsigned long large;      /* Allocations bigger than any class */
+    slab_class_stats_t cls[SLAB_MAX_CLASSES];
+} slab_stats_t;
+
+void slab_init(size_t budget, int hugepages);
+void *slab_alloc(size_t n);
+void slab_free(void *p, size_t n);
+void slab_stats(slab_stats_t *st);
+
+#endif /* __SLAB_H__ */